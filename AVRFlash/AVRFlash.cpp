@@ -8,17 +8,20 @@
 #include <Arduino.h>
 #include "stk500.h"
 #include "AVRFlash.h"
+#include <TraceRing.h>
 
 #define CB_INTERVAL      5   // check uart every N milliseconds
+#define PUMP_INTERVAL    1   // check uart every N milliseconds while programming pages
 #define INIT_DELAY     150   // wait this many millisecs before sending anything
 #define BAUD_INTERVAL  600   // interval after which we change baud rate
 #define PGM_TIMEOUT  20000   // timeout after sync is achieved, in milliseconds
 #define PGM_INTERVAL   200   // send sync at this interval in ms when in programming mode
 #define ATTEMPTS         8   // number of attempts total to make
 
-#define DBG(fmt, ...) _debug(PSTR(fmt), __VA_ARGS__)
+// TRC records an event in the binary trace ring, see TraceRing.h
+#define TRC(...) trace(__VA_ARGS__)
 
-static char* progStates[] = { "init", "sync", "sig", "ver0", "ver1", "idle", "prog" };
+static const char* progStates[] = { "init", "sync", "sig", "ver0", "ver1", "idle", "prog" };
 
 // HardwareSerial doesn't expose a way to set the baudrate, so we need a hack while this gets sorted
 // out...
@@ -30,9 +33,7 @@ void AVRFlash::setBaudrate(uint32_t rate) {
 
 // sync initiates the flashing operation by starting the AVR reset and sync operations.
 void AVRFlash::sync() {
-    DBG("AVRFlash::sync @br=%d\n", _confBaud);
-    // TODO: check that there are not two programming requests at the same time
-    // TODO: lock uart from serial bridge
+    TRC(trAvrSync, _baudCnt, _confBaud);
 
     // check that we know the reset pin, else error out with that
     if (_resetPin < 0) {
@@ -40,6 +41,13 @@ void AVRFlash::sync() {
         return;
     }
 
+    // take the uart from the serial bridge, this also keeps two programming requests from
+    // running at the same time
+    if (_arbiter && !_arbiter->take(this)) {
+        strcpy(_errMessage, "uart is busy");
+        return;
+    }
+
     // issue reset and start timer to get sync response
     setBaudrate(_confBaud);
     resetAVR();
@@ -60,7 +68,9 @@ void AVRFlash::sync() {
 // registered. If it hasn't yet then when finish() will be called it will call the CB immediately
 // itself since hasError() will be true.
 void AVRFlash::checkFinish() {
+    _timer.detach(); // it repeats while programming pages
     if (_doneCB) {
+        releaseUart();
         (*_doneCB)(_doneCBArg);
     } else if (!hasError()) {
         // checkFinish should only be called when there is an error
@@ -75,6 +85,14 @@ void AVRFlash::resetAVR() {
     digitalWrite(_resetPin, 1);
 }
 
+// releaseUart hands the uart back to the serial bridge, once what we wrote has gone out since the
+// bridge restores its own baud rate.
+void AVRFlash::releaseUart() {
+    if (_arbiter == 0 || !_arbiter->heldBy(this)) return;
+    _uart.flush();
+    _arbiter->release(this);
+}
+
 static void _timerCB(AVRFlash*_this) { _this->timerCB(); }
 
 // arm the one-shot timer so we move to the next state
@@ -89,7 +107,7 @@ static const int baudrates[] = { 0, 9600, 57600, 115200 };
 void AVRFlash::nextBaud() {
     setBaudrate(_baudCnt%4 == 0 ? _confBaud : baudrates[_baudCnt%4]);
     _baudCnt++;
-    DBG("changing to %ld baud\n", _baudrate);
+    TRC(trAvrBaud, _baudCnt, _baudrate);
 }
 
 void AVRFlash::fetchUart() {
@@ -102,7 +120,7 @@ void AVRFlash::fetchUart() {
 
 void AVRFlash::processAcks() {
     while (_responseLen >= 2 && _responseBuf[0] == STK_INSYNC && _responseBuf[1] == STK_OK) {
-        if (_ackWait) _ackWait = false;
+        if (_acksDue > 0) _acksDue--;
         memmove(_responseBuf, _responseBuf+2, _responseLen-2);
         _responseLen -= 2;
     }
@@ -127,7 +145,7 @@ void AVRFlash::timerCB() {
             _stateStart = millis();
             _startTime = _stateStart;
             armTimer(CB_INTERVAL);
-            DBG("got sync, sending read-sig \n", 0);
+            TRC(trAvrInSync);
             return;
         }
         if (millis()-_stateStart < BAUD_INTERVAL-INIT_DELAY) {
@@ -138,101 +156,127 @@ void AVRFlash::timerCB() {
         if (_baudCnt > ATTEMPTS) {
             // we're doomed, give up
             sprintf(_errMessage, "sync abandoned after %d attempts", _baudCnt);
-            DBG("%s\n", _errMessage);
+            TRC(trAvrError, _progState);
             checkFinish();
             return;
         }
         // time to switch baud rate and issue a reset
-        DBG("no sync response @%d baud\n", _baudrate);
+        TRC(trAvrNoSync, _baudCnt, _baudrate);
         nextBaud();
         resetAVR();
         _progState = stateInit;
         armTimer(INIT_DELAY);
         return;
-    case stateIdle: // we need to send the next programming command if we can
-        fetchUart();
-        processAcks();
-        if (_lastPage != 0) {
-            // we have a page we can flash!
-            FlashPage *fp = _lastPage->next;
-            if (_lastPage == fp) {
-                _lastPage = 0;
-                if (_resume != 0) (*_resume)(_resumeArg);
+    case stateIdle: // waiting for a page to program
+    case stateProg: // waiting for the acks of the page being programmed
+        pump();
+        return;
+    default: // we're trying to get some info from optiboot so we need to check whether it responded
+        if (parseResponse()) {
+            _stateStart = millis();
+            if (_progState == stateIdle) {
+                // optiboot is ready, from now on the pump looks for acks and pages every ms
+                _timer.attach_ms<AVRFlash*>(PUMP_INTERVAL, &_timerCB, this);
             } else {
-                _lastPage->next = fp->next;
+                armTimer(CB_INTERVAL);
             }
-            programPage(*fp);
-            delete fp;
-            _progState = stateProg;
-            _stateStart = millis();
-            armTimer(CB_INTERVAL);
             return;
         }
-        if (_doneCB) {
-            // we got the final callback info, this means no more data, we're done!
-            // tell optiboot to reboot into the sketch
-            _uart.write(STK_LEAVE_PROGMODE);
-            _uart.write(CRC_EOP);
-            // perform the callback
-            (*_doneCB)(_doneCBArg);
-            return;
-        }
-        if (millis()-_startTime > PGM_TIMEOUT) {
-            strcpy(_errMessage, "programming time-out");
-            DBG("%s\n", _errMessage);
+        if (hasError()) {
+            TRC(trAvrError, _progState);
             checkFinish();
             return;
         }
         if (millis()-_stateStart > PGM_INTERVAL) {
-            _uart.write(STK_GET_SYNC);
-            _uart.write(CRC_EOP);
-            _ackWait=true; // we now expect an ACK
-            _stateStart = millis();
-        }
-        armTimer(CB_INTERVAL);
-        return;
-    case stateProg: // we're programming and we're waiting for the ack
-        fetchUart();
-        processAcks();
-        if (!_ackWait) {
-            //DBG("Programmed page\n", 0);
-            _progState = stateIdle;
-            _stateStart = millis();
-            _uart.write(STK_GET_SYNC);
-            _uart.write(CRC_EOP);
-            _ackWait=true; // we now expect an ACK
-            armTimer(CB_INTERVAL);
-            return;
-        }
-        if (millis()-_stateStart > PGM_INTERVAL) {
-            strcpy(_errMessage, "no response to page programming command");
-            DBG("%s\n", _errMessage);
+            sprintf(_errMessage, "no response in state %s(%d) @%d baud\n",
+                    progStates[_progState], _progState, _baudrate);
+            TRC(trAvrError, _progState);
             checkFinish();
             return;
         }
         armTimer(CB_INTERVAL);
         return;
-    default: // we're trying to get some info from optiboot so we need to check whether it responded
-        if (parseResponse()) {
-            _stateStart = millis();
-            armTimer(CB_INTERVAL);
+    }
+}
+
+// pump drives the programming of the pages, it's called every PUMP_INTERVAL ms once optiboot is in
+// sync. A page goes out as an STK_LOAD_ADDRESS and an STK_PROG_PAGE back-to-back and the next one
+// follows as soon as the acks of both have arrived. It can't go out earlier: optiboot polls its
+// uart and doesn't receive anything while it writes the page to flash. The ticker keeps running
+// for the whole session, so each call also checks for the next page, the end of the image, and
+// the timeouts, but the uart is only read once it has received something.
+void AVRFlash::pump() {
+    if (_acksDue > 0) {
+        if (_uart.available() > 0) {
+            fetchUart();
+            processAcks();
+            if (_acksDue > 0 && _responseLen >= 2) {
+                sprintf(_errMessage, "bad response to programming command: 0x%02x 0x%02x",
+                        _responseBuf[0], _responseBuf[1]);
+                TRC(trAvrError, _progState);
+                checkFinish();
+                return;
+            }
+        }
+        if (_acksDue > 0) {
+            if (millis()-_stateStart > PGM_INTERVAL) {
+                strcpy(_errMessage, _progState == stateProg ?
+                        "no response to page programming command" : "no response to sync");
+                TRC(trAvrError, _progState);
+                checkFinish();
+            }
             return;
         }
-        if (hasError()) {
-            DBG("%s\n", _errMessage);
+        if (_progState == stateProg) {
+            TRC(trAvrPageDone);
+            _progState = stateIdle;
+        }
+        _stateStart = millis();
+    }
+
+    // we have a page we can flash! programPage sends it all, so the slot can be reused
+    FlashPage *fp = nextPage();
+    if (fp != 0) {
+        if (!programPage(*fp)) {
+            TRC(trAvrError, _progState);
             checkFinish();
             return;
         }
-        if (millis()-_stateStart > PGM_INTERVAL) {
-            sprintf(_errMessage, "no response in state %s(%d) @%d baud\n",
-                    progStates[_progState], _progState, _baudrate);
-            DBG("%s\n", _errMessage);
+        freePage();
+        if (hasError()) { // the record waiting for the slot was bad
+            TRC(trAvrError, _progState);
             checkFinish();
             return;
         }
-        armTimer(CB_INTERVAL);
+        _progState = stateProg;
+        _stateStart = millis();
         return;
     }
+    if (_doneCB) {
+        // we got the final callback info, this means no more data, we're done!
+        // tell optiboot to reboot into the sketch
+        _uart.write(STK_LEAVE_PROGMODE);
+        _uart.write(CRC_EOP);
+        // hand the uart back and perform the callback
+        TRC(trAvrDone);
+        _timer.detach();
+        releaseUart();
+        (*_doneCB)(_doneCBArg);
+        return;
+    }
+    if (millis()-_startTime > PGM_TIMEOUT) {
+        strcpy(_errMessage, "programming time-out");
+        TRC(trAvrError, _progState);
+        checkFinish();
+        return;
+    }
+    // keep optiboot from timing out while we wait for data
+    if (millis()-_stateStart > PGM_INTERVAL) {
+        _uart.write(STK_GET_SYNC);
+        _uart.write(CRC_EOP);
+        _acksDue++;
+        _stateStart = millis();
+    }
 }
 
 #if 0
@@ -268,13 +312,14 @@ bool AVRFlash::checkSyncAck() {
     return false;
 }
 
-// programPage starts the programming of a page by sending the address and the data.
+// programPage starts the programming of a page by sending the address and the data without waiting
+// for the ack of the address.
 bool AVRFlash::programPage(FlashPage &fp) {
     if (fp.len > _pageSz) {
         strcpy(_errMessage, "Internal error: FlashPage too long");
         return false;
     }
-    DBG("Programming %d@0x%x\n", fp.len, fp.addr);
+    TRC(trAvrPage, fp.len, fp.addr);
 
     // send address to optiboot (little endian format)
     _uart.write(STK_LOAD_ADDRESS);
@@ -283,18 +328,6 @@ bool AVRFlash::programPage(FlashPage &fp) {
     _uart.write(addr >> 8);
     _uart.write(CRC_EOP);
 
-    // wait a brief amt to get an ack
-    _ackWait=true;
-    uint32_t t0 = millis();
-    while (_ackWait) {
-        if (millis()-t0 > 2) {
-            strcpy(_errMessage,"flashing failed in load address");
-            return false;
-        }
-        fetchUart();
-        processAcks();
-    }
-
     // send page length (big-endian format, go figure...)
     _uart.write(STK_PROG_PAGE);
     _uart.write(fp.len>>8);
@@ -304,7 +337,7 @@ bool AVRFlash::programPage(FlashPage &fp) {
     // send page content
     _uart.write(fp.data, fp.len);
     _uart.write(CRC_EOP);
-    _ackWait=true;
+    _acksDue += 2;
     return true;
 }
 
@@ -353,6 +386,7 @@ bool AVRFlash::parseResponse() {
         }
         strcpy(_errMessage, "did not get optiboot version high");
         return false;
+    default:
+        return false;
     }
-    return false;
 }
@@ -7,6 +7,7 @@
 
 #include <ESPAsyncWebServer.h>
 #include <Ticker.h>
+#include <UartArbiter.h>
 #include "HexRecord.h"
 
 #define RESP_SZ 64
@@ -24,17 +25,21 @@ enum AVRProgStates {     // overall programming states
 struct AVRFlash : HexRecord {
     // the constructor allocates the memory necessary for the flashing operation. An AVRFlash object
     // should only be used once and a new one allocated to perform the next flash operation.
-    AVRFlash(HardwareSerial &uart, uint8_t resetPin, int baudrate=115200) :
+    // If the uart is shared, e.g. with the serial bridge, the arbiter hands it over for the
+    // duration of the flashing operation.
+    AVRFlash(HardwareSerial &uart, uint8_t resetPin, int baudrate=115200,
+            UartArbiter *arbiter=0) :
         HexRecord(128),
         _progState(stateInit),
         _stateStart(0),
         _baudCnt(0),
-        _ackWait(false),
+        _acksDue(0),
         _optibootVers(0),
         _baudrate(0),
         _confBaud(baudrate),
         _uart(uart),
         _resetPin(resetPin),
+        _arbiter(arbiter),
         _doneCB(0),
         _doneCBArg(0),
         _responseLen(0)
@@ -44,6 +49,7 @@ struct AVRFlash : HexRecord {
 
     ~AVRFlash() {
         _timer.detach();
+        releaseUart();
     }
 
     // sync initiates the flashing operation by starting the AVR reset and sync operations.
@@ -55,6 +61,7 @@ struct AVRFlash : HexRecord {
     template< typename ARG >
     void finish(void (*doneCB)(ARG), ARG cbArg) {
         if (hasError()) {
+            releaseUart();
             (*doneCB)(cbArg);
             return;
         }
@@ -67,6 +74,7 @@ struct AVRFlash : HexRecord {
         _doneCB = 0; // just in case
         _timer.detach();
         resetAVR(); // avoid leaving it in some weird state
+        releaseUart();
     }
 
     // private
@@ -76,24 +84,27 @@ struct AVRFlash : HexRecord {
     AVRProgStates _progState; // programming state
     uint32_t _stateStart;  // when we started the current _progState
     short _baudCnt;        // counter for sync attempts at different baud rates
-    bool _ackWait;         // expecting an ACK
+    uint8_t _acksDue;      // number of STK_INSYNC+STK_OK acks expected from optiboot
     uint16_t _optibootVers;
     uint32_t _baudrate;    // baud rate at which we're programming
     uint32_t _confBaud;    // baud rate configured/requested
 
     HardwareSerial &_uart;
     uint8_t _resetPin;
+    UartArbiter *_arbiter; // hands out the uart, null if it isn't shared
 
     void (*_doneCB)(void*);     // callback to be made when programming completes or errors
     void *_doneCBArg;
 
-    char _responseBuf[RESP_SZ]; // buffer to accumulate responses from optiboot
+    uint8_t _responseBuf[RESP_SZ]; // buffer to accumulate responses from optiboot
     short _responseLen;    // amount accumulated so far
 
     void setBaudrate(uint32_t);
     void checkFinish();
     void resetAVR();
+    void releaseUart();
     void timerCB();
+    void pump();
     void armTimer(uint32_t ms);
     void nextBaud();
     void fetchUart();
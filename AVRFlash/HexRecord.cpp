@@ -2,42 +2,26 @@
 // Copyright (c) 2016-2017 by Danny Backx
 
 #include <Arduino.h>
+#include <TraceRing.h>
 #include "HexRecord.h"
 
-#define DBG(fmt, ...) _debug(PSTR(fmt), __VA_ARGS__)
+// TRC records an event in the binary trace ring, see TraceRing.h
+#define TRC(...) trace(__VA_ARGS__)
 
-// verify that N chars are hex characters
-bool HexRecord::checkHex(uint8_t *buf, short len) {
-  while (len--) {
-    char c = *buf++;
-    if ((c >= '0' && c <= '9') || (c >= 'A' && c <= 'F') || (c >= 'a' && c <= 'f'))
-      continue;
-    return false;
-  }
-  return true;
-}
+// hexTab maps the ASCII chars to their hex value, chars that aren't hex digits map to 0xff
+static const uint8_t hexTab[128] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+       0,    1,    2,    3,    4,    5,    6,    7,    8,    9, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff,   10,   11,   12,   13,   14,   15, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff,   10,   11,   12,   13,   14,   15, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
 
-// get hex value of some hex characters
-uint32_t HexRecord::getHexValue(uint8_t *buf, short len) {
-  uint32_t v = 0;
-  while (len--) {
-    v = (v<<4) | (uint32_t)(*buf & 0xf);
-    if (*buf > '9') v += 9;
-    buf++;
-  }
-  return v;
-}
-
-// verify checksum
-bool HexRecord::verifyChecksum(uint8_t *buf, short len) {
-  uint8_t sum = 0;
-  while (len >= 2) {
-    sum += (uint8_t)getHexValue(buf, 2);
-    buf += 2;
-    len -= 2;
-  }
-  return sum == 0;
-}
+// hexNibble returns the value of a hex digit or 0xff if c isn't one
+static inline uint8_t hexNibble(uint8_t c) { return c < 128 ? hexTab[c] : 0xff; }
 
 // append one string to another but visually escape non-printing characters in the appended
 // string using \x00 hex notation, max is the max chars in the concatenated string.
@@ -64,154 +48,201 @@ void HexRecord::appendPretty(uint8_t *buf, int max, uint8_t *raw, int rawLen) {
   buf[off] = 0;
 }
 
-// write accepts data in the form of hex records to be flashed to the uC. It accumulates the
-// input into the '_saved' buffer from where it processes hex records. The hex records are then
-// enqueued for programming when the uC is ready.
+// write accepts data in the form of hex records to be flashed to the uC. It parses the records in
+// a single pass as the data arrives: each pair of hex chars is decoded once, using a table, into
+// _rec, which holds the part of the record decoded so far, so records may be split across calls
+// and nothing is ever copied or shifted. The checksum is summed up along the way. Complete records
+// are processed and the resulting pages enqueued for programming when the uC is ready. When the
+// pool is full the rest of the data is held until freePage makes room, so the caller never has to
+// hang on to it.
 uint32_t HexRecord::_write(uint8_t *data, size_t len) {
-    //DBG("HexRecord::write %d bytes\n", len);
-    bool qEmpty = _lastPage == 0;
-    uint32_t ret = len; // need to return len on success
+    uint32_t n = 0;
+    if (!_stopped) {
+        n = parse(data, len);
+        if (hasError()) return 0;
+        if (!_stopped) return len;
+        if (_stop) (*_stop)(_stopArg);
+    }
+    // hold on to the data the pool has no room for
+    if (_heldLen + len-n > _heldMax) {
+        sprintf(_errMessage, "Too much data while the page pool is full, max %d", _heldMax);
+        return 0;
+    }
+    memcpy(_held+_heldLen, data+n, len-n);
+    _heldLen += len-n;
+    return len;
+}
 
-    // iterate through the data received, parse HEX records, and enqueue them
-    while (len > 0) {
-        // first fill-up the saved buffer
-        short saveLen = strlen((char*)_saved);
-        if (saveLen < _pageSz) {
-            short cpy = _pageSz-saveLen;
-            if (cpy > len) cpy = len;
-            memcpy(_saved+saveLen, data, cpy);
-            saveLen += cpy;
-            data += cpy;
-            len -= cpy;
-            _saved[saveLen] = 0; // string terminator
-            //DBG("cp %d buff->saved\n", cpy);
+// parse decodes and processes the records in the data, it stops short when the pool has no room
+// for a record, which it leaves in _rec. It returns the number of chars consumed, 0 on error.
+uint32_t HexRecord::parse(uint8_t *data, size_t len) {
+    uint8_t *p = data, *end = data+len;
+
+    while (p < end) {
+        if (_recNeed == 0) {
+            // between records: skip CR/LF, then expect the start of a record
+            uint8_t c = *p++;
+            if (c == '\n' || c == '\r') continue;
+            if (c != ':') {
+                sprintf(_errMessage, "Expected start of record in POST data, got %c", c);
+                return 0;
+            }
+            _recNeed = 1; // the count byte, it tells how many more follow
+            _recLen = 0;
+            _recHi = 0;
+            _recSum = 0;
+            continue;
         }
 
-        // process HEX records
-        while (saveLen >= 11) { // 11 is minimal record length
-            // skip any CR/LF
-            short skip = 0;
-            while (skip < saveLen && (_saved[skip] == '\n' || _saved[skip] == '\r'))
-                skip++;
-            if (skip > 0) {
-                // shift out cr/lf (keep terminating \0)
-                memmove(_saved, _saved+skip, saveLen+1-skip);
-                saveLen -= skip;
-                if (saveLen < 11) break;
-                //DBG("skip %d cr/lf\n", skip);
+        // decode hex pairs, a pair split across calls leaves its high nibble in _recHi
+        while (_recLen < _recNeed && p < end) {
+            uint8_t hi, lo;
+            if (_recHi) {
+                hi = _recHi & 0xf;
+                lo = hexNibble(*p++);
+                _recHi = 0;
+            } else if (p+1 < end) {
+                hi = hexNibble(p[0]);
+                lo = hexNibble(p[1]);
+                p += 2;
+            } else {
+                hi = hexNibble(*p++);
+                lo = 0;
+                if (hi <= 0xf) _recHi = 0x10 | hi;
             }
-
-            // inspect whether we have a proper record start
-            if (_saved[0] != ':') {
-                DBG("found non-: start\n", 0);
-                sprintf(_errMessage, "Expected start of record in POST data, got %c", _saved[0]);
+            if ((hi | lo) > 0xf) {
+                strcpy(_errMessage, "Invalid hex character found");
                 return 0;
             }
+            if (_recHi) break; // need the other half
+            uint8_t b = hi<<4 | lo;
+            _rec[_recLen++] = b;
+            _recSum += b;
+            if (_recLen == 1) _recNeed = 5+b; // count, address, type, data, checksum
+        }
+        if (_recLen < _recNeed) break; // need more data to complete the record
 
-            if (!checkHex(_saved+1, 2)) return 0; // error... checkHex sets _errMessage
-            uint8_t recLen = getHexValue(_saved+1, 2);
-            //DBG("record %d\n", recLen);
-
-            // process record
-            if (saveLen < 11+recLen*2) break; // need more data to fill-in first...
-            if (!processRecord(_saved, 11+recLen*2)) return 0; // processRecord sets _errMessage
-            if (qEmpty && _lastPage != 0) (*_stop)(_stopArg); // added first page, tell input to stop
-
-            // shift record out of _saved buffer
-            short shift = 11+recLen*2;
-            memmove(_saved, _saved+shift, saveLen+1-shift);
-            saveLen -= shift;
-            //DBG("OB %d byte record\n", shift);
+        // process the complete record
+        _recNeed = 0;
+        if (_recSum != 0) {
+            sprintf(_errMessage, "Invalid checksum for record at 0x%04x", _rec[1]<<8 | _rec[2]);
+            return 0;
+        }
+        if (!hasRoom()) {
+            // the pool is full, the record stays in _rec until freePage makes room for it
+            _stopped = true;
+            return p-data;
         }
+        if (!processRecord()) return 0; // processRecord sets _errMessage
     }
-    return ret;
+    return len;
 }
 
-// addPage appends a page to the list of pages to be programmed
-void HexRecord::addPage() {
-    //DBG("HexRecord::addPage(@0x%x, %d bytes)\n", _address, _pageLen);
-    FlashPage *fp = (FlashPage*)calloc(1, 3*4+_pageLen);
-    if (fp == 0) {
-        strcpy(_errMessage, "out of memory");
-        return;
-    }
-
-    fp->len = _pageLen;
-    fp->addr = _address;
-    memcpy(fp->data, _pageBuf, _pageLen);
-    // add to end of page list
-    if (_lastPage) {
-        fp->next = _lastPage->next;
-        _lastPage->next = fp;
-    } else {
-        fp->next = fp;
-    }
-    _lastPage = fp;
+// hasRoom returns whether there are enough free slots in the pool for the pages the record in
+// _rec starts.
+bool HexRecord::hasRoom() {
+    if (_rec[3] != 0x00 || _rec[0] == 0) return true; // only data records start pages
+    uint32_t addr = _base + (_rec[1]<<8 | _rec[2]);
+    uint32_t first = addr & ~(uint32_t)(_pageSz-1);
+    uint32_t last = (addr+_rec[0]-1) & ~(uint32_t)(_pageSz-1);
+    uint16_t pages = (last-first)/_pageSz + 1;
+    if (_pageLen > 0 && first == fillPage()->addr) pages--; // continues the open page
+    return _count + (_pageLen > 0) + pages <= _slots;
+}
 
+// addPage appends the page being accumulated to the queue of pages to be programmed, the data is
+// already in its slot. The page is trimmed after the last byte written, rounded up to a whole word.
+void HexRecord::addPage() {
+    FlashPage *fp = fillPage();
+    fp->len = (_pageLen+1) & ~1;
+    _count++;
     _pageLen = 0;
+    uint32_t i = fp->addr / _pageSz;
+    _queued[i>>3] |= 1<<(i&7);
 }
 
-// processRecord parses a hex record and typically appends to a flashPage
-// assumes that the records starts with ':' & hex length
-bool HexRecord::processRecord(uint8_t *buf, short len) {
-    buf++; len--; // skip leading ':'
-
-    // check we have all hex chars
-    if (!checkHex(buf, len)) {
-        sprintf(_errMessage, "Invalid hex character found");
-        return false;
+// freePage returns the page at the head of the queue to the pool and, if write() stopped, parses
+// as much of the held data as fits now. The input is resumed once all of it is in. If the held
+// data turns out to be bad the input isn't resumed, the caller has to check hasError().
+void HexRecord::freePage() {
+    if (_count == 0) return;
+    if (++_head == _slots) _head = 0;
+    _count--;
+    if (_stopped && hasRoom()) {
+        _stopped = false;
+        if (!processRecord()) return; // processRecord sets _errMessage
+        uint32_t n = parse(_held, _heldLen);
+        if (hasError()) return;
+        _heldLen -= n;
+        memmove(_held, _held+n, _heldLen);
+        if (!_stopped && _resume) (*_resume)(_resumeArg);
     }
+}
 
-    // verify checksum
-    if (!verifyChecksum(buf, len)) {
-        buf[len>32?32:len] = 0; // avoid _errMessage buffer overflow
-        sprintf(_errMessage, "Invalid checksum for record %s", buf);
-        return false;
-    }
+// processRecord processes the decoded and checksummed record in _rec, typically appending its data
+// to the page being accumulated.
+bool HexRecord::processRecord() {
+    uint8_t recLen = _rec[0];
+    uint8_t type = _rec[3];
+    uint8_t *data = _rec+4;
 
     // dispatch based on record type
-    uint8_t type = getHexValue(buf+6, 2);
     switch (type) {
     case 0x00: { // Intel HEX data record
-        //DBG("REC data %ld pglen=%d\n", getHexValue(buf, 2), _pageLen);
-        uint32_t addr = getHexValue(buf+2, 4);
-        // check whether this is disjoint from data we have accumulated
-        if (_pageLen > 0 && addr != ((_address+_pageLen)&0xffff)) {
-           addPage();
-        }
-        // set address, unless we're adding to the end (_addPage call may have changed pageLen)
-        if (_pageLen == 0) {
-           _address = (_address & 0xffff0000) | addr;
+        // the data goes into the page(s) it belongs to, which are assembled on device page
+        // boundaries (page sizes are powers of 2) with any gaps filled with 0xff
+        uint32_t addr = _base + (_rec[1]<<8 | _rec[2]);
+        while (recLen > 0) {
+            uint32_t page = addr & ~(uint32_t)(_pageSz-1);
+            uint16_t off = addr - page;
+            uint16_t n = _pageSz - off;
+            if (n > recLen) n = recLen;
+            // queue the open page if the data belongs to another page
+            if (_pageLen > 0 && page != fillPage()->addr) addPage();
+            // open the page, unless it has been queued already, which would erase it, sections
+            // may come in any order as long as they don't share a page with an earlier one
+            FlashPage *fp = fillPage();
+            if (_pageLen == 0) {
+                uint32_t i = page / _pageSz;
+                if (page >= HEX_FLASH_MAX) {
+                    sprintf(_errMessage, "Record for 0x%05x is beyond the end of flash", addr);
+                    return false;
+                }
+                if (_queued[i>>3] & 1<<(i&7)) {
+                    sprintf(_errMessage, "Record for 0x%05x is in a page that's been queued", addr);
+                    return false;
+                }
+                fp->addr = page;
+                memset(fp->data, 0xff, _pageSz);
+            }
+            memcpy(fp->data+off, data, n);
+            if (off+n > _pageLen) _pageLen = off+n;
+            // queue the page as soon as its last byte is in
+            if (off+n == _pageSz) addPage();
+            addr += n;
+            data += n;
+            recLen -= n;
         }
-        // append record
-        uint16_t recLen = getHexValue(buf, 2);
-        for (uint16_t i=0; i<recLen; i++)
-           _pageBuf[_pageLen++] = getHexValue(buf+8+2*i, 2);
-        // add page, if we have a full page
-        if (_pageLen >= _pageSz) addPage();
         break; }
     case 0x01: // Intel HEX EOF record
         // add any remaining partial page
         if (_pageLen > 0) addPage();
         _eof = true;
         break;
-    case 0x04: // Intel HEX address record
-        DBG("HexRecord::processRecord: address 0x%x\n", getHexValue(buf+8, 4) << 16);
-        // add any remaining partial page
-        if (_pageLen > 0) addPage();
-        _address = getHexValue(buf+8, 4) << 16;
+    case 0x04: // Intel HEX extended linear address record
+        // the open page can continue, pages don't straddle a 64KB boundary
+        _base = (uint32_t)(data[0]<<8 | data[1]) << 16;
+        TRC(trHexBase, type, _base);
         break;
     case 0x05: // Intel HEX start address (MDK-ARM only)
         // ignore, there's no way to tell optiboot that...
         break;
-    case 0x02: // Intel HEX extended segment address record
-        // Depending on the case, just ignoring this record could solve the problem
-        // _segment = getHexValue(buf+8, 4) << 4;
-        //DBG("segment 0x%08X\n", _segment);
-        return true;
+    case 0x02: // Intel HEX extended segment address record, avr-objcopy uses these beyond 64KB
+        _base = (uint32_t)(data[0]<<8 | data[1]) << 4;
+        TRC(trHexBase, type, _base);
+        break;
     default:
-        // DBG("OB bad record type\n");
-        sprintf(_errMessage, "Invalid/unknown record type: 0x%02x, packet %s", type, buf);
+        sprintf(_errMessage, "Invalid/unknown record type: 0x%02x", type);
         return false;
     }
     return true;
@@ -5,10 +5,15 @@
 #define _PGM_DATA_H_
 
 #define ERR_MAX 128
+#define HEX_REC_MAX (5+255)   // max decoded record: count, address, type, data, checksum
+#define HEX_PAGE_SLOTS 4      // default number of pages in the pool
+#define HEX_FLASH_MAX 0x40000 // largest AVR flash, 256KB on the ATmega2560
+#ifndef HEX_CHUNK_MAX
+#define HEX_CHUNK_MAX 1460    // max chars passed to write() at a time, e.g. a TCP segment
+#endif
 
 // FlashPage describes a page of flash to be programmed.
 struct FlashPage {
-    FlashPage *next;
     uint16_t len;
     uint16_t pad;
     uint32_t addr;
@@ -17,38 +22,56 @@ struct FlashPage {
 
 // structure used to remember request details from one callback to the next
 struct HexRecord {
-    HexRecord(uint32_t pageSize) :
+    HexRecord(uint32_t pageSize, uint8_t slots=HEX_PAGE_SLOTS, uint16_t chunkMax=HEX_CHUNK_MAX) :
         _pageLen(0),
-        _address(0),
-        _lastPage(0),
+        _base(0),
+        _slotSz((sizeof(FlashPage)+pageSize+3) & ~3),
+        _slots(slots),
+        _head(0),
+        _count(0),
+        _stopped(false),
         _stop(0),
         _stopArg(0),
         _resume(0),
         _resumeArg(0),
+        _held(0),
+        _heldLen(0),
+        _heldMax(chunkMax),
         _pageSz(pageSize),
         _pgmDone(0),
         _startTime(0),
         _eof(0),
-        _mega(false)
+        _recLen(0),
+        _recNeed(0),
+        _recHi(0),
+        _recSum(0),
+        _mega(false),
+        _debug(0)
     {
         _errMessage[0] = 0;
-        _pageBuf = (uint8_t*)calloc(1, pageSize+pageSize/2);
-        _saved = (uint8_t*)calloc(1, 128); // need space for string terminator
-        if (!_pageBuf || !_saved) {
+        // the pool needs room for the open page plus the pages a record of 255 bytes can span
+        uint8_t minSlots = 2 + (pageSize-1+254)/pageSize;
+        if (_slots < minSlots) _slots = minSlots;
+        _pool = (uint8_t*)calloc(_slots, _slotSz);
+        _held = (uint8_t*)malloc(chunkMax);
+        _queued = (uint8_t*)calloc((HEX_FLASH_MAX/pageSize+7)/8, 1);
+        if (!_pool || !_held || !_queued) {
             strcpy(_errMessage, "Out of memory");
         }
     }
 
     ~HexRecord() {
-        if (_pageBuf) free(_pageBuf);
-        if (_saved) free(_saved);
+        if (_pool) free(_pool);
+        if (_held) free(_held);
+        if (_queued) free(_queued);
     }
 
     // write a buffer of hex records to flash. This really just parses the hex records and
-    // places the info/data into FlashPage structs. If stop and resume are non-null,
-    // it calls stop(cbArg) while parsing when it enqueues a page and it arranges for resume(cbArg)
-    // to be called when the last page is dequeued.
-    // It returns the number of bytes written (really: it returns len on success and 0 on failure).
+    // places the info/data into the FlashPage slots of the pool, assembling whole device pages.
+    // It consumes all of the data and returns len, or 0 on error, see getError(). When the pool
+    // fills up it holds on to the rest of the data, up to HEX_CHUNK_MAX chars, and calls
+    // stop(cbArg) if non-null. freePage() works through the held data as pages are programmed
+    // and calls resume(cbArg) once it's all in, the caller must not write more in between.
     template<typename ARG>
     uint32_t write(uint8_t *data, size_t len, void (*stop)(ARG), void (*resume)(ARG), ARG cbArg) {
         if (hasError()) return 0;
@@ -59,6 +82,13 @@ struct HexRecord {
         return _write(data, len);
     }
 
+    // nextPage returns the next page to be programmed, or null if there is none
+    FlashPage *nextPage() { return _count > 0 ? slot(_head) : 0; }
+    // freePage returns the page returned by nextPage to the pool, check hasError() afterwards:
+    // the data write() held on to is processed as it fits, and resume is only called once all
+    // of it is in without error
+    void freePage();
+
     // hasError returns true if an error occurred
     bool hasError() { return _errMessage[0] != 0; }
     // getError() returns an error description as a string (or null if no error)
@@ -66,23 +96,38 @@ struct HexRecord {
 
     // private
 
-    uint8_t *_saved;            // buffer for saved incomplete hex records
-    // current page being accumulated
-    uint8_t *_pageBuf;          // buffer for received data to be sent to AVR
-    uint16_t _pageLen;          // number of bytes in pageBuf
-    uint32_t _address;          // address to write next page to
-    // queue of pages to be programmed
-    FlashPage *_lastPage;       // pointer to last page, _lastPage->next points to first page
+    // current page being accumulated, in the slot following the queued pages, its addr is the
+    // address of the device page and bytes not written by records are 0xff
+    uint16_t _pageLen;          // number of bytes up to the last one written, 0 if no open page
+    uint32_t _base;             // base address set by extended address records
+    uint8_t *_queued;           // bitmap of the pages that have been queued for programming
+    // pool of pages, used as a ring: the queued pages to be programmed are followed by the page
+    // being accumulated
+    uint8_t *_pool;             // the slots
+    uint16_t _slotSz;           // size of a slot in bytes, FlashPage header included
+    uint8_t _slots;             // number of slots
+    uint8_t _head;              // slot of the next page to be programmed
+    uint8_t _count;             // number of pages queued to be programmed
+    bool _stopped;              // the pool is full, the record in _rec doesn't fit
     void (*_stop)(void*);       // callback to stop input into write()
     void *_stopArg;
     void (*_resume)(void*);     // callback to resume input into write()
     void *_resumeArg;
+    // data write() got while the pool was full, it's parsed as freePage() makes room
+    uint8_t *_held;             // the held chars
+    uint16_t _heldLen;          // number of held chars
+    uint16_t _heldMax;          // size of _held, the max chars per write()
 
     uint16_t _pageSz;           // size of flash page to be programmed at a time
     uint32_t _pgmDone;          // number of bytes programmed
     uint32_t _startTime;        // time of program POST request
     bool _eof;                  // got EOF record
-    //uint32_t _segment;          // for extended segment addressing, added to the address field
+    // record being parsed, it's decoded as the chars arrive so it can span write() calls
+    uint8_t _rec[HEX_REC_MAX];  // decoded bytes of the record
+    uint16_t _recLen;           // number of bytes decoded so far
+    uint16_t _recNeed;          // number of bytes in the record, 0 between records
+    uint8_t _recHi;             // pending high nibble + 0x10, 0 if none
+    uint8_t _recSum;            // checksum of the bytes decoded so far
 
     char _errMessage[ERR_MAX];  // error message
 
@@ -93,15 +138,21 @@ struct HexRecord {
     //uint8_t  _lfuse, _hfuse, _efuse;
 
     // methods
-    static bool checkHex(uint8_t *buf, short len);
-    static uint32_t getHexValue(uint8_t *buf, short len);
     static void appendPretty(uint8_t *buf, int max, uint8_t *raw, int rawLen);
-    static bool verifyChecksum(uint8_t *buf, short len);
     uint32_t _write(uint8_t *data, size_t len);
-    bool processRecord(uint8_t *buf, short len);
+    uint32_t parse(uint8_t *data, size_t len);
+    bool processRecord();
+    bool hasRoom();
     void addPage();
+    // slot returns the i'th slot of the ring, i < 2*_slots
+    FlashPage *slot(uint8_t i) {
+        if (i >= _slots) i -= _slots;
+        return (FlashPage*)(_pool + i*_slotSz);
+    }
+    FlashPage *fillPage() { return slot(_head+_count); }
 
-    // debug sets the printf function used for info/debug messages
+    // debug sets the printf function used for info/debug messages, HexRecord itself records
+    // trace events instead, see TraceRing.h
     void debug(void dbgPrintf(const char*, ...)) { _debug = dbgPrintf; }
     void (*_debug)(const char*, ...);
 };
@@ -0,0 +1,77 @@
+// Esp-link-v4 Serial Bridge
+// Copyright (C) 2018 by Throsten von Eicken
+
+#ifndef SbrRing_h
+#define SbrRing_h
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+// SbrRing is a fixed-capacity byte fifo. The storage is allocated once up-front and data is
+// drained in place, so moving data through the ring involves no heap operations and no copying
+// beyond the single memcpy into the ring.
+struct SbrRing {
+    SbrRing() : _buf(0), _size(0), _rd(0), _len(0) {}
+
+    // alloc allocates the storage for the ring, it returns false if out of memory
+    bool alloc(uint16_t size) {
+        if (_buf && _size == size) { clear(); return true; }
+        release();
+        _buf = (uint8_t *)malloc(size);
+        if (_buf == 0) return false;
+        _size = size;
+        return true;
+    }
+    // release frees the storage of the ring
+    void release() {
+        if (_buf) free(_buf);
+        _buf = 0;
+        _size = 0;
+        clear();
+    }
+    // clear empties the ring without releasing the storage
+    void clear() { _rd = 0; _len = 0; }
+
+    bool     allocated() { return _buf != 0; }
+    bool     empty() { return _len == 0; }
+    uint16_t used() { return _len; }
+    uint16_t space() { return _size - _len; }
+
+    // put appends up to len bytes to the ring and returns the number of bytes appended
+    uint16_t put(const uint8_t *data, size_t len) {
+        if (len > space()) len = space();
+        uint16_t wr = _rd + _len;
+        if (wr >= _size) wr -= _size;
+        uint16_t n = _size - wr; // contiguous space at the write index
+        if (n > len) n = len;
+        memcpy(_buf+wr, data, n);
+        memcpy(_buf, data+n, len-n);
+        _len += len;
+        return len;
+    }
+
+    // front returns a pointer to the oldest byte in the ring and contiguous the number of bytes
+    // that can be read starting at front() without wrapping around
+    uint8_t *front() { return _buf+_rd; }
+    uint16_t contiguous() { return _rd+_len > _size ? _size-_rd : _len; }
+
+    // consume drops n bytes from the front of the ring, typically after they have been written
+    // out from front()
+    void consume(uint16_t n) {
+        if (n > _len) n = _len;
+        _rd += n;
+        if (_rd >= _size) _rd -= _size;
+        _len -= n;
+        if (_len == 0) _rd = 0; // maximize contiguous space for the next put
+    }
+
+    // private
+
+    uint8_t  *_buf;  // malloc'ed storage
+    uint16_t _size;  // size of storage in bytes
+    uint16_t _rd;    // index of the oldest byte
+    uint16_t _len;   // number of bytes in the ring
+};
+
+#endif // SbrRing_h
@@ -2,64 +2,485 @@
 // Copyright (C) 2018 by Throsten von Eicken
 
 // The SerialBridge library provides a full-duplex transparent bridge between TCP connections and a
-// uart. It allows an arbitrary number of TCP connections (resources permitting...) to all receive
-// characters coming in on the uart, as well as to send characters to the uart.
+// uart. It allows a configurable number of TCP connections to all receive characters coming in on
+// the uart, as well as to send characters to the uart. The client descriptors come from a fixed
+// pool allocated by begin, connections beyond its size are refused by resetting them, and the
+// descriptors of closed connections are recycled, so reconnects never grow the memory use.
+// Connections whose client stops acking, e.g. because its wifi dropped, are closed after an ack
+// timeout so the data held for them is released and the other clients don't stall, and
+// optionally idle connections are closed and TCP keepalives detect dead ones that are quiet.
 //
-// This library is written for the esp8266 and uses the ESPAsyncTCP library. It is fixed to use the
-// esp8266's only full uart (uart0/Serial).
+// This library is written for the esp8266 and uses the ESPAsyncTCP library. SerialBridgePort is a
+// template over the type of the port it bridges, so any number of independent bridges can run,
+// each with its own port, TCP port and buffers, e.g. one on Serial and one on a software uart, and
+// the calls to the port are resolved at compile time. SerialBridge bridges a HardwareSerial, by
+// default uart0/Serial, the esp8266's only full uart. The port must provide the HardwareSerial
+// methods used by the bridge: begin, setRxBufferSize, available, availableForWrite, read, write,
+// hasOverrun, baudRate and updateBaudRate; a thin wrapper can adapt other stream types.
 //
 // The TCP-to-Uart path uses TCP ack back-pressure to limit the amount of buffering required. The
 // ESPAsyncTCP library calls handleData with a packet at a time and the SerialBridge only ACKs the
 // characters as they are stuffed into the uart and buffers the remainder of the packet. As a
 // result, the buffer space is a max of 4 MSS, i.e. 4*536 or 4*1460 bytes depending on the LwIP
-// configuration chosen.
+// configuration chosen. Each client gets a ring buffer of that size when it connects, so the
+// data path itself never allocates. Acking only what the uart has taken makes the flow stop&go
+// when the round trip is long compared to the time the uart takes to drain the window: the
+// sender's window opens only after the uart has run dry. Optionally the bridge acks ahead: the
+// chars it expects the uart to drain within a horizon, estimated from the baud rate, are acked
+// while they're still buffered, up to a fixed budget that is added to the buffer size.
 //
-// The Uart-to-TCP path uses only the buffer in the uart driver. When there are characters to
-// transmit it determines the max number that can be sent on all TCP connections, reads those from
-// the buffer, and then transmits them.
+// The Uart-to-TCP path reads characters from the uart driver's buffer in bulk into a shared tx
+// ring and keeps a position in the ring for each client, so each client is sent its backlog at its
+// own pace. A client whose backlog reaches the size of the ring is lagging and the lag policy
+// determines what happens: block everyone until it catches up (the default, which pushes the
+// backlog into the uart driver's buffer), drop its oldest data, or disconnect it. The data is
+// handed to LwIP without copying, so each client pins up to TCP_SND_BUF bytes of the ring until
+// they are acked, except when dropping data, which requires reclaiming ring space from clients that
+// stopped acking, so the data is copied into the TCP send buffer instead.
+//
+// By default anything that arrives on the uart is sent right away, which at high baud rates
+// produces a flood of tiny TCP segments. The coalescing policy holds back a client's backlog until
+// it reaches a byte count, until the oldest char has waited for a max delay, or until a flush
+// char, such as a newline, arrives. A client can opt out of coalescing by having its setNoDelay
+// flag set, typically in the onClient callback.
+//
+// Normally the bridge only moves data when loop() is called, so its latency depends on everything
+// else the sketch does in its loop. In event-driven mode the bridge is serviced as soon as there is
+// work: when a client sends or acks data, and when a 1ms timer finds that the uart's rx buffer
+// reached a threshold or that buffered data can be written to the uart. Each activation moves at
+// most a budget of chars in each direction so the bridge doesn't starve the rest of the system.
+//
+// When several clients send at the same time the writer policy determines how they share the uart.
+// By default whatever arrives is written right away, so the data of different clients gets mixed
+// at arbitrary points. Alternatively one client gets exclusive use of the uart until it pauses, or
+// clients with data take turns, either switching after a quantum of chars or at the end of a
+// message, e.g. a line, so multi-byte commands are not broken up. A client waiting for its turn
+// holds on to its data and TCP back-pressure stops it from sending more.
+//
+// In framed mode the bridge understands the packet protocol spoken over the uart, either SLIP or
+// length-prefixed frames, and only ever sends complete frames: each frame, or batch of frames,
+// that arrives on the uart goes to a client in a single TCP send, and each frame a client sends is
+// written to the uart only once it has been fully received, without frames of other clients mixed
+// in. The frames are passed on unchanged, so the TCP stream uses the same encoding as the uart.
+// Frame boundaries are found with memchr (SLIP) or by skipping over the frames (length prefix),
+// so the data is not decoded char by char. The sbrDropOldest lag policy can cut a frame short,
+// which SLIP recovers from at the next frame but the length prefix does not.
+//
+// The bridge can keep a history of the recent uart output so a client that connects late, e.g.
+// after the device crashed, still gets to see what happened. The history is replayed to each new
+// client before it gets live data, starting at the oldest line in the history that isn't older
+// than a max age, optionally with each line prefixed by the time it arrived. The replay is copied
+// out of the history, so a replaying client doesn't hold up the others: if it can't keep up it
+// loses the history that gets overwritten. The timestamps are meant for text output and are not
+// inserted in framed mode.
+//
+// Browsers can connect through a WebSocket endpoint that the sketch adds to its web server. Its
+// clients join the same fan-out as the TCP clients, using binary messages, which are copies of the
+// data in the tx ring, so the lag policy applies once a client's message queue is full. Their
+// input is acked by the WebSocket layer, so there is no back-pressure and what doesn't fit in the
+// client's rx buffer is dropped and counted in its rxDropped statistic.
+//
+// For telemetry, where latency matters more than reliability, the bridge can also speak UDP. Peers
+// subscribe by sending a datagram to the UDP port, and unsubscribe by going quiet for
+// SBR_UDP_EXPIRE_MS. Each datagram in either direction starts with a 16-bit big-endian sequence
+// number followed by the payload, an empty payload just keeps the subscription alive. The uart
+// data is sent to all subscribers in datagrams of up to a max size, or once the oldest char has
+// waited for a max delay, and since sending copies the data, UDP never holds up the tx ring. A
+// received payload is written to the uart in one piece if there's room and no TCP client holds
+// the uart, and dropped otherwise. The bridge counts per peer the datagrams lost according to the
+// sequence numbers and those dropped, and the peers can count the gaps in what they receive. UDP
+// can't be combined with RFC 2217 mode.
+//
+// The uart can be shared with other users, e.g. AVRFlash, through a UartArbiter. When another user
+// takes the uart the bridge first fans out what is in the uart's rx buffer and then pauses: it no
+// longer reads or writes the uart, and the data clients send stays in their buffers, unacked, so
+// TCP back-pressure holds them off and nothing is dropped. When the uart is handed back the bridge
+// restores its baud rate and config and carries on, the clients stay connected throughout.
+//
+// In RFC 2217 mode the connections speak telnet with the COM port control option, which lets
+// clients change the baud rate and framing, toggle DTR and RTS, and send breaks. To keep the data
+// path fast, 0xFF chars coming from the uart are escaped once as they're read into the shared tx
+// ring, where a chunk without 0xFF costs a single memchr, and packets received from a client are
+// only parsed if they contain a 0xFF or arrive in the middle of a telnet command.
 //
 // The main limitation of the SerialBridge is buffer size, which is constrained by the esp8266
-// memory. On the TCP-to-Uart path thanks to the TCP back pressure the amount of buffering required
-// is bounded. However, due to the limitations of the LwIP library it can easily lead to hiccups,
-// i.e., stop&go type of flow. On the Uart-to-TCP path there is no reasonable buffer bound and it is
-// easy for Wifi packet loss and other network or receiver hiccups to cause characters to be lost
-// due to buffer overflow. Implementing uart flow-control could solve this...
+// memory. All the buffers are allocated up front and have a fixed size: each client's rx ring on
+// the TCP-to-Uart path, the shared tx ring on the Uart-to-TCP path, and the uart driver's rx
+// buffer. On the TCP-to-Uart path the TCP back pressure keeps the data within the client's rx ring,
+// although the limitations of the LwIP library can lead to hiccups, i.e., stop&go type of flow. On
+// the Uart-to-TCP path nothing stops the device from sending, so when Wifi packet loss or other
+// network or receiver hiccups make a client fall the size of the tx ring behind, the lag policy
+// either drops data, disconnects the client, or blocks, in which case the uart driver's buffer
+// fills up and then overflows. Enabling uart flow-control solves this: RTS is deasserted when the
+// uart driver's buffer fills up, or when clients fall behind and the lag policy blocks, and the
+// device pauses until it's asserted again. CTS is honored on the TCP-to-Uart path, but since the
+// device only stops new writes, it must accept the up to 128 chars in the uart's tx fifo after it
+// deasserts CTS. Both are driven in software using GPIO pins because the uart's hardware flow
+// control only sees the 128-byte fifo, not the driver's buffer or the clients' backlog.
+//
+// The stop&go behavior can be diagnosed by tracing: the data path records binary events in the
+// trace ring of the TraceRing library, which costs next to nothing when tracing is off and little
+// enough when it's on not to change the flow being traced.
 
 #ifndef SerialBridge_h
 #define SerialBridge_h
 
 #include <stdlib.h>
+#include <Ticker.h>
 #include "ESPAsyncTCP.h"
+#include "ESPAsyncUDP.h"
+#include "ESPAsyncWebServer.h"
+#include "UartArbiter.h"
+#include "SbrRing.h"
+
+// SBR_RXBUF_SZ is the size of the per-client buffer on the TCP-to-uart path. It must hold a full
+// TCP receive window since that is the amount of data a client may send without getting acks.
+#ifndef SBR_RXBUF_SZ
+#define SBR_RXBUF_SZ TCP_WND
+#endif
+
+// SBR_MAX_CLIENTS is the default max number of clients connected at the same time.
+#ifndef SBR_MAX_CLIENTS
+#define SBR_MAX_CLIENTS 4
+#endif
+
+// SBR_UDP_PEERS is the max number of UDP subscribers, which expire after SBR_UDP_EXPIRE_MS without
+// a datagram.
+#ifndef SBR_UDP_PEERS
+#define SBR_UDP_PEERS 4
+#endif
+#ifndef SBR_UDP_EXPIRE_MS
+#define SBR_UDP_EXPIRE_MS 60000
+#endif
+
+// SBR_WS_MSG_MAX is the max size of a binary message sent to a WebSocket client.
+#ifndef SBR_WS_MSG_MAX
+#define SBR_WS_MSG_MAX 1024
+#endif
 
 // SbrClient holds the state we need for one TCP client.
-struct SbrClient;
+template<class Port> struct SbrClient;
+
+// SbrLagPolicy determines what happens to a client that falls a full tx ring behind.
+enum SbrLagPolicy {
+    sbrBlock = 0,       // stop reading the uart until the client catches up
+    sbrDropOldest,      // drop the oldest data the client hasn't been sent yet
+    sbrDisconnect,      // disconnect the client
+};
+
+// SbrWriterPolicy determines how clients that send at the same time share the uart.
+enum SbrWriterPolicy {
+    sbrWriteAny = 0,    // write whatever arrives right away
+    sbrWriteExclusive,  // one client holds the uart until it has been idle for the lease time
+    sbrWriteRoundRobin, // clients with data take turns writing a quantum of chars
+    sbrWriteMessage,    // clients with data take turns, switching at the end of a message
+};
 
-struct SerialBridge {
-    SerialBridge() : _overrun(false), _disabled(false), _debug(0) {}
+// SbrFraming selects the packet protocol spoken over the uart in framed mode.
+enum SbrFraming {
+    sbrRaw = 0,         // no framing, the data is a stream of chars
+    sbrSlip,            // SLIP, frames are terminated by an END char (0xC0)
+    sbrLenPrefix,       // frames are preceded by their length, big-endian
+};
+
+// SbrFrameParser finds the frame boundaries in a stream.
+struct SbrFrameParser {
+    SbrFrameParser() : left(0), hdr(0), hdrLen(0) {}
+    size_t scan(const uint8_t *data, size_t len, SbrFraming mode, uint8_t lenBytes,
+            bool first=false);
+    // atEnd returns true if the stream parsed so far ends with a complete length-prefixed frame
+    bool atEnd() { return left == 0 && hdrLen == 0; }
+
+    uint16_t left;      // chars left in the current length-prefixed frame
+    uint16_t hdr;       // length prefix being received
+    uint8_t  hdrLen;    // number of chars of the length prefix received
+};
+
+// SBR_HIST_MARKS is the number of lines in the history for which the time is recorded, at most one
+// every SBR_HIST_MARK_MS.
+#define SBR_HIST_MARKS 32
+#define SBR_HIST_MARK_MS 10
+
+// SbrHistMark records the time at which a line in the history arrived.
+struct SbrHistMark {
+    uint32_t pos;       // position of the start of the line
+    uint32_t ms;        // millis() when the line arrived
+};
+
+// SbrUdpPeer holds the address and statistics of a UDP subscriber.
+struct SbrUdpPeer {
+    IPAddress ip;
+    uint16_t port;              // 0 if the slot is free
+    uint16_t rxSeq;             // sequence number of the next datagram expected from the peer
+    uint32_t lastSeen;          // time in millis() the last datagram arrived
+    uint32_t rxDatagrams;       // datagrams received from the peer
+    uint32_t rxLost;            // datagrams missing from the peer's sequence
+    uint32_t rxDropped;         // datagrams dropped because the uart was full or busy
+    uint32_t txDatagrams;       // datagrams sent to the peer
+    uint32_t txFailed;          // datagrams that couldn't be sent, e.g. out of memory
+};
+
+// SBR_LOOP_HIST is the number of buckets in the histogram of loop() durations.
+#define SBR_LOOP_HIST 16
+
+// SbrStats holds bridge-wide statistics, the counters run from begin() or the last resetStats().
+struct SbrStats {
+    uint32_t overruns;          // number of times the uart driver reported an rx overrun
+    uint32_t sendFailed;        // number of failed TCP send() calls
+    uint32_t frameErrors;       // number of frames that exceeded the max frame size
+    uint32_t refused;           // number of connections refused because all clients are in use
+    uint16_t uartHigh;          // high-water mark of the uart driver's rx buffer
+    uint16_t txRingHigh;        // high-water mark of the shared tx ring
+    uint16_t clients;           // number of connected clients (not reset)
+    uint32_t loopHist[SBR_LOOP_HIST]; // loop() durations, bucket i counts durations < 2^i us
+};
+
+// SbrClientStats holds per-client statistics.
+struct SbrClientStats {
+    IPAddress remoteIP;
+    uint16_t remotePort;
+    bool     connected;
+    uint32_t bytesIn;           // bytes received from the client (TCP-to-uart)
+    uint32_t bytesOut;          // bytes sent to the client (uart-to-TCP)
+    uint32_t ackLater;          // number of packets whose ack had to be deferred
+    uint32_t ackedAhead;        // chars acked before they were written to the uart
+    uint32_t dropped;           // bytes dropped due to the lag policy
+    uint32_t rxDropped;         // bytes from the client dropped because the rx buffer was full
+    uint16_t rxBufHigh;         // high-water mark of the rx buffer
+    uint16_t rxBuf;             // current fill of the rx buffer (not reset)
+    uint16_t txBacklog;         // current uart-to-TCP backlog (not reset)
+};
+
+template<class Port>
+struct SerialBridgePort {
+    SerialBridgePort(Port &port) : _port(port), _pool(0), _free(0),
+        _maxClients(SBR_MAX_CLIENTS), _poolSize(0),
+        _idleMs(0), _ackTimeoutMs(5000), _keepAliveSec(0),
+        _txBuf(0), _txSize(0), _txHead(0), _lagPolicy(sbrBlock),
+        _flushBytes(1), _flushDelay(0), _flushChar(-1), _txFlushPos(0),
+        _rtsPin(-1), _ctsPin(-1), _rtsStopped(false), _clientCB(0), _clientCBArg(0),
+        _evThreshold(64), _evBudget(0), _evPollMs(1), _evIdle(0),
+        _ackAheadMax(0), _ackHorizonMs(20), _active(false),
+        _writerPolicy(sbrWriteAny), _writer(0), _writerQuantum(64), _writerUsed(0),
+        _writerLease(100), _writerLast(0), _writerMsgEnd('\n'), _writerAtEnd(false),
+        _framing(sbrRaw), _maxFrame(1024), _frameLenBytes(2), _txFramePos(0),
+        _hist(0), _histSize(0), _histBase(0), _histMaxAge(0), _histStamps(false),
+        _histMarks(0), _histMarkCnt(0),
+        _udp(0), _udpPort(0), _udpMax(512), _udpFlushUs(2000), _udpSince(0), _udpNext(0),
+        _udpSeq(0), _udpSubs(0), _udpBuf(0),
+        _telnet(false), _dtrPin(-1), _dtrOn(true), _breakOn(false), _flowCtl(true),
+        _uartConfig(SERIAL_8N1), _baud(115200),
+        _overrun(false), _disabled(false), _paused(false), _debug(0)
+    {
+        memset(&_stats, 0, sizeof(_stats));
+    }
 
     // begin operation of the serial bridge, the default rxBufSz provides 173ms of buffering at
-    // 115200 baud
-    void begin(uint16_t port=2323, uint32_t baudrate=115200, uint32_t rxBufSz=2000);
+    // 115200 baud. Flow control is enabled by passing the gpio numbers used for RTS and/or CTS,
+    // RTS is deasserted when the uart's rx buffer is 3/4 full and asserted again at 1/4 full.
+    void begin(uint16_t port=2323, uint32_t baudrate=115200, uint32_t rxBufSz=2000,
+            int8_t rtsPin=-1, int8_t ctsPin=-1);
     // loop must be called from the arduino loop function to perform background tasks
     void loop();
-    // debug printf function used for info/debug messages
+    // debug printf function used for this bridge's info/debug messages
     void debug(void dbgPrintf(const char*, ...));
-    // disable turns the serial bridge off temporarily, e.g. to use the uart for something else
+    // backlog sets the size of the shared tx ring (rounded up to a power of 2) and the policy for
+    // clients that fall that far behind, it must be called before begin. The size should be at
+    // least 2*TCP_SND_BUF so a client can have a full send buffer in flight, which is the default.
+    void backlog(uint16_t size, SbrLagPolicy policy=sbrBlock);
+    // coalesce sets the coalescing policy on the uart-to-TCP path: a client's backlog is sent
+    // once it reaches bytes chars, once its oldest char has waited for delayUs microseconds, or
+    // once it contains flushChar (-1 for none). The default of 1 byte sends everything right away.
+    void coalesce(uint16_t bytes, uint32_t delayUs, int16_t flushChar=-1);
+    // onClient registers a callback that is made for each new client connection, e.g. to set
+    // options such as setNoDelay(true), which also exempts the client from coalescing
+    template<typename ARG>
+    void onClient(void (*clientCB)(ARG, AsyncClient*), ARG cbArg) {
+        _clientCB = (void(*)(void*, AsyncClient*))clientCB;
+        _clientCBArg = (void*)cbArg;
+    }
+    // stats returns bridge-wide statistics
+    void stats(SbrStats &st);
+    // clientStats fills in the statistics for up to max clients and returns the number filled in
+    size_t clientStats(SbrClientStats *st, size_t max);
+    // resetStats clears the counters and high-water marks
+    void resetStats();
+    // eventDriven makes the bridge service itself as soon as there is work, rather than only when
+    // loop() is called. rxThreshold is the number of chars in the uart's rx buffer that triggers
+    // an activation, budget the max chars moved in each direction per activation, and pollMs
+    // the interval at which the uart is checked. It must be called before begin.
+    void eventDriven(uint16_t rxThreshold=64, uint16_t budget=512, uint8_t pollMs=1);
+    // ackAhead lets the bridge ack up to maxBytes buffered chars of each client before they're
+    // written to the uart, namely those the uart is expected to drain within horizonMs (at most
+    // 1000), which keeps the sender's window open when the network round trip is long. Each
+    // client's buffer grows by maxBytes, which is limited to 0xFFFF-SBR_RXBUF_SZ so the buffer
+    // size fits in 16 bits. It must be called before begin.
+    void ackAhead(uint16_t maxBytes, uint16_t horizonMs=20);
+    // writers sets the policy for clients that send at the same time. Quantum is the number of
+    // chars a client writes before its turn passes, with sbrWriteMessage at the end of the message
+    // reached after that, which is marked by msgEnd. LeaseMs is how long the uart stays with a
+    // client that has nothing to write, for sbrWriteExclusive and in the middle of a message.
+    void writers(SbrWriterPolicy policy, uint16_t quantum=64, uint8_t msgEnd='\n',
+            uint16_t leaseMs=100);
+    // framing enables framed mode using SLIP or a length prefix of lenBytes (1 or 2) chars. A
+    // frame longer than maxFrame is considered garbage and passed on as is. The writer policy is
+    // changed to switch between clients at frame boundaries. It must be called before begin and
+    // can't be combined with RFC 2217 mode.
+    void framing(SbrFraming mode, uint16_t maxFrame=1024, uint8_t lenBytes=2);
+    // history keeps the last size chars (rounded up to a power of 2) received on the uart and
+    // replays them to each new client, except for lines older than maxAgeMs (0 for no limit),
+    // prefixing each line with the time in seconds since boot if timestamps is set. It must be
+    // called before begin.
+    void history(uint16_t size, uint32_t maxAgeMs=0, bool timestamps=false);
+    // timeouts sets when connections are closed: after idleMs without data or acks from the
+    // client (0 to never close idle connections), and after ackMs without an ack for data in
+    // flight, which releases the data held for a dead client so the others don't stall. TCP
+    // keepalives are sent after keepAliveSec (0 for none) without traffic, which detects dead
+    // connections that have nothing in flight. It must be called before clients connect.
+    void timeouts(uint32_t idleMs, uint32_t ackMs=5000, uint16_t keepAliveSec=0);
+    // webSocket adds the clients of a WebSocket endpoint, which the sketch adds to its
+    // AsyncWebServer, to the bridge. They use binary messages and are otherwise treated like the
+    // TCP clients.
+    void webSocket(AsyncWebSocket &ws);
+    // udp enables the UDP transport on port, with uart data sent in datagrams of up to
+    // maxDatagram chars, or once the oldest char has waited for flushUs. It must be called before
+    // begin.
+    void udp(uint16_t port, uint16_t maxDatagram=512, uint32_t flushUs=2000);
+    // udpStats fills in the statistics of up to max UDP subscribers and returns the number filled
+    size_t udpStats(SbrUdpPeer *st, size_t max);
+    // maxClients sets the max number of clients connected at the same time, connections beyond
+    // it are refused. It must be called before begin.
+    void maxClients(uint8_t max);
+    // rfc2217 enables the telnet COM port control protocol on all connections. DTR drives dtrPin
+    // (active low, -1 for none), RTS drives the rtsPin passed to begin when a client turns flow
+    // control off. It must be called before begin.
+    void rfc2217(int8_t dtrPin=-1);
+    // arbiter makes the bridge the resident user of the uart managed by arb, so it pauses while
+    // another user holds the uart.
+    void arbiter(UartArbiter &arb);
+    // disable turns the serial bridge off temporarily, e.g. to use the uart for something else,
+    // data from the clients is held back until enable is called
     void disable() { _disabled = true; }
     // enable re-enables after a disable
     void enable() { _disabled = false; }
 
     // private
 
+    SbrClient<Port> *newClient(AsyncClient* client, AsyncWebSocketClient *ws);
     void handleNewClient(AsyncClient* client);
-    void recvUartCheck();
-    void recvTCPCheck();
+    void handleWebSocket(AsyncWebSocketClient *ws, AwsEventType type, uint8_t *data, size_t len);
+    void handleDatagram(AsyncUDPPacket &pkt);
+    void udpSend();
+    void uartPause(bool paused);
+    // uartOff returns true if the bridge must leave the uart alone
+    bool uartOff() { return _disabled || _paused; }
+    uint32_t txTail();
+    size_t txMakeRoom(size_t need);
+    void txToClient(SbrClient<Port> *cli);
+    bool txDue(SbrClient<Port> *cli);
+    void recvUartCheck(size_t budget);
+    void recvTCPCheck(size_t budget);
+    void activate();
+    void poll();
+    int uartWritable();
+    size_t uartDrain(SbrClient<Port> *cli);
+    size_t uartWrite(SbrClient<Port> *cli, const uint8_t *data, size_t len);
+    void writerCheck();
+    void writerPass();
+    size_t txEscape(size_t n);
+    void txScanFlush(size_t n);
+    void txScanFrames(size_t n);
+    void histRecord(size_t n);
+    uint32_t histOldest();
+    void histStart(SbrClient<Port> *cli);
+    void txReplay(SbrClient<Port> *cli);
+    void comPortCmd(SbrClient<Port> *cli, uint8_t cmd, const uint8_t *val, size_t len);
+    void uartBreak(bool on);
+    void rtsCheck();
     void gc();
 
-    std::vector<SbrClient*> _clients; // a list to hold all clients
+    // uart being bridged, its methods are called as _port.Port::read() etc. so the calls bind to
+    // Port's own implementation statically instead of going through the Stream/Print vtable
+    Port &_port;
+    std::vector<SbrClient<Port>*> _clients; // a list to hold all clients
+    SbrClient<Port> *_pool;    // client descriptors
+    SbrClient<Port> *_free;    // free list of client descriptors
+    uint8_t _maxClients;       // size of the pool to allocate in begin
+    uint8_t _poolSize;         // size of the allocated pool
+    uint32_t _idleMs;          // idle timeout, 0 for none
+    uint32_t _ackTimeoutMs;    // ack timeout
+    uint16_t _keepAliveSec;    // TCP keepalive idle time, 0 for none
+    uint8_t *_txBuf;           // shared ring of chars read from the uart
+    uint16_t _txSize;          // size of _txBuf, a power of 2, 0 until backlog() or begin()
+    uint32_t _txHead;          // position of next char to read into _txBuf
+    SbrLagPolicy _lagPolicy;
+    uint16_t _flushBytes;      // coalescing: backlog size that triggers a send
+    uint32_t _flushDelay;      // coalescing: max time in microseconds chars are held back
+    int16_t _flushChar;        // coalescing: char that triggers a send, -1 for none
+    uint32_t _txFlushPos;      // position in _txBuf just past the last flush char
+    int8_t _rtsPin;            // gpio for RTS output, -1 if not used
+    int8_t _ctsPin;            // gpio for CTS input, -1 if not used
+    uint16_t _rtsHigh;         // uart rx buffer level at which RTS is deasserted
+    uint16_t _rtsLow;          // uart rx buffer level at which RTS is asserted again
+    bool _rtsStopped;          // RTS is deasserted
+    void (*_clientCB)(void*, AsyncClient*); // callback for new client connections
+    void *_clientCBArg;
+    SbrStats _stats;
+    Ticker _ticker;            // timer to poll the uart in event-driven mode
+    uint16_t _evThreshold;     // uart rx buffer level that triggers an activation
+    uint16_t _evBudget;        // max chars moved per activation, 0 if not event-driven
+    uint8_t _evPollMs;         // poll interval
+    uint8_t _evIdle;           // number of polls chars have been sitting below the threshold
+    uint16_t _ackAheadMax;     // max chars acked ahead of the uart per client, 0 for none
+    uint16_t _ackHorizonMs;    // chars expected to drain within this time are acked ahead
+    bool _active;              // bridge is being serviced, used to prevent recursion
+    SbrWriterPolicy _writerPolicy;
+    SbrClient<Port> *_writer;  // client holding the uart, if any
+    uint16_t _writerQuantum;   // chars a client writes per turn
+    uint16_t _writerUsed;      // chars the holder has written in this turn
+    uint16_t _writerLease;     // ms the uart stays with a client that has nothing to write
+    uint32_t _writerLast;      // time in millis() of the holder's last write
+    uint8_t _writerMsgEnd;     // char that ends a message
+    bool _writerAtEnd;         // the holder's last char ended a message
+    SbrFraming _framing;
+    uint16_t _maxFrame;        // max frame size
+    uint8_t _frameLenBytes;    // size of the length prefix
+    SbrFrameParser _txParser;  // finds the frames received on the uart
+    uint32_t _txFramePos;      // position in the tx ring past the last complete frame
+    uint8_t *_hist;            // history ring, indexed by positions in the tx ring
+    uint16_t _histSize;        // size of the history, a power of 2
+    uint32_t _histBase;        // position of the first char ever recorded in the history
+    uint32_t _histMaxAge;      // max age in ms of the lines that are replayed
+    bool _histStamps;          // prefix replayed lines with timestamps
+    SbrHistMark *_histMarks;   // times of recent lines, allocated together with _hist
+    uint32_t _histMarkCnt;     // number of marks ever recorded
+    AsyncUDP *_udp;            // UDP socket, null if UDP is off
+    uint16_t _udpPort;         // UDP port, 0 if UDP is off
+    uint16_t _udpMax;          // max payload of a datagram
+    uint32_t _udpFlushUs;      // max time chars are held back for a datagram
+    uint32_t _udpSince;        // time in micros() the oldest unsent char arrived
+    uint32_t _udpNext;         // position in the tx ring of the next char to send over UDP
+    uint16_t _udpSeq;          // sequence number of the next datagram
+    uint8_t _udpSubs;          // number of subscribers
+    uint8_t *_udpBuf;          // datagram being sent
+    SbrUdpPeer _udpPeers[SBR_UDP_PEERS];
+    bool _telnet;              // RFC 2217 mode
+    int8_t _dtrPin;            // gpio driven by DTR in RFC 2217 mode
+    bool _dtrOn, _breakOn;     // state of DTR and break
+    bool _flowCtl;             // RTS/CTS flow control is enabled, a client may turn it off
+    uint8_t _uartConfig;       // data bits, parity and stop bits, see SerialConfig
+    uint32_t _baud;            // baud rate, restored when the uart is handed back
     bool _overrun; // state used to only warn once per overrun event
-    bool _disabled;
+    bool _disabled;            // turned off by the app, see disable()
+    bool _paused;              // the arbiter handed the uart to another user
     void (*_debug)(const char*, ...);
 };
 
+#include "SerialBridgeImpl.h"
+
+// SerialBridge bridges a hardware uart, Serial unless another one is passed in.
+struct SerialBridge : SerialBridgePort<HardwareSerial> {
+    SerialBridge(HardwareSerial &port=Serial) : SerialBridgePort<HardwareSerial>(port) {}
+};
+
 #endif // SerialBridge_h
@@ -0,0 +1,1626 @@
+// Esp-link-v4 Serial Bridge
+// Copyright (C) 2018 by Throsten von Eicken
+
+// SerialBridgeImpl.h holds the implementation of the SerialBridgePort template, it is included by
+// SerialBridge.h and not meant to be included directly. The macros are undefined at the end and
+// the telnet and SLIP constants live in the sbr_detail namespace so they don't leak into the
+// sketch.
+
+#ifndef SerialBridgeImpl_h
+#define SerialBridgeImpl_h
+
+#include "Arduino.h"
+#include "TraceRing.h"
+
+// INFO is used to print infrequent informational messages, e.g. when a client connects/disconnects
+#define INFO(...) do { if (sbrOf(this)->_debug) sbrOf(this)->_debug(__VA_ARGS__); } while (0)
+// TRC records an event in the binary trace ring, which allows the exact flow of data to be traced
+// without altering the timing of the code, see TraceRing.h
+#define TRC(...) trace(__VA_ARGS__)
+
+namespace sbr_detail {
+
+// telnet codes, options, and parser states used in RFC 2217 mode
+enum { tnSE=240, tnSB=250, tnWILL=251, tnWONT=252, tnDO=253, tnDONT=254, tnIAC=255 };
+enum { tnoBinary=0, tnoSGA=3, tnoComPort=44 };
+enum { tnsData=0, tnsIac, tnsSb, tnsSbIac }; // plus tnWILL..tnDONT while expecting the option
+
+// RFC 2217 COM port commands sent by the client, the server responds with the command + 100
+enum {
+    cpSignature=0, cpSetBaudrate, cpSetDatasize, cpSetParity, cpSetStopsize, cpSetControl,
+    cpFlowSuspend=8, cpFlowResume, cpLinestateMask, cpModemstateMask, cpPurgeData,
+};
+
+// SLIP_END terminates a SLIP frame.
+static const uint8_t SLIP_END = 0xC0;
+
+} // namespace sbr_detail
+
+// SBR_OOB_MAX is the max number of telnet responses that can be in flight to a client.
+#define SBR_OOB_MAX 4
+
+// SbrClient holds the state we need for one TCP client.
+template<class Port>
+struct SbrClient {
+    SerialBridgePort<Port> *sbr;
+    AsyncClient *client;    // handle to ESPAsyncTCP client
+    SbrRing     rxBuf;      // received characters that have not been written to the uart yet
+    uint32_t    txNext;     // position in the bridge's tx ring of next char to send to client
+    uint32_t    txAcked;    // position in the tx ring of oldest char not acked by the client
+    uint32_t    txSince;    // time in micros() when the backlog went from empty to non-empty
+    bool        lagging;    // client has lost data and not caught up yet
+    bool        suspended;  // client asked us to stop sending using FLOWCONTROL-SUSPEND
+    SbrClientStats stats;
+    // telnet state for RFC 2217 mode
+    uint8_t     tnState;    // parser state
+    uint8_t     tnOpts;     // options enabled, see tnOptBit
+    uint8_t     sbLen;      // length of the sub-negotiation in sbBuf
+    uint8_t     sbBuf[8];   // sub-negotiation being received
+    uint8_t     ctlLen;     // length of the responses in ctlBuf
+    uint8_t     ctlBuf[32]; // responses waiting to be sent
+    uint8_t     oobCnt;     // number of responses in flight
+    uint32_t    oobPos[SBR_OOB_MAX]; // position in the tx ring at which a response was sent
+    uint16_t    oobLen[SBR_OOB_MAX]; // number of bytes of the response that haven't been acked
+    // framed mode state
+    SbrFrameParser rxParser; // finds the frames received from the client
+    SbrFrameParser wrParser; // finds the frames written to the uart, for the writer policy
+    uint16_t    rxFramed;   // number of chars at the front of rxBuf that form complete frames
+    uint16_t    ahead;      // number of chars at the front of rxBuf that have been acked
+    // history replay state
+    bool        replaying;  // client is being sent the history, txNext is a history position
+    uint32_t    replayMark; // index of the next history mark to consider for a timestamp
+    uint32_t    copied;     // bytes sent during the replay that haven't been acked
+    SbrClient   *nextFree;  // next descriptor in the pool's free list
+    AsyncWebSocketClient *ws; // WebSocket client, client is then its TCP connection
+    uint32_t    lastActive; // time in millis() the client last sent or acked data
+    bool        dead;       // the connection timed out and is to be closed
+
+    size_t rxBufToUart(size_t max);
+    void ackAhead();
+    // ack acks n chars received from a TCP client, a WebSocket client's TCP connection is acked
+    // by the WebSocket layer
+    void ack(size_t n) { if (client && !ws) client->ack(n); }
+    size_t copyOut(const char *data, size_t len);
+    bool send() { return ws || client->send(); }
+    size_t telnetIn(uint8_t *data, size_t len);
+    void telnetOption(uint8_t verb, uint8_t opt);
+    void ctlPut(const uint8_t *data, size_t len);
+    void comPortReply(uint8_t cmd, const uint8_t *val, size_t len);
+    bool ctlFlush();
+    void handleError(int8_t error);
+    void handleData(void *data, size_t len);
+    void handleAck(size_t len);
+    void handleDisconnect();
+    void handleTimeout(uint32_t time);
+};
+
+// sbrOf returns the bridge a message is printed for, so the INFO macro works in the methods of the
+// bridge and of its clients.
+template<class Port>
+inline SerialBridgePort<Port> *sbrOf(SerialBridgePort<Port> *sbr) { return sbr; }
+template<class Port>
+inline SerialBridgePort<Port> *sbrOf(SbrClient<Port> *cli) { return cli->sbr; }
+
+// rxBufToUart writes up to max chars from the rx buffer to the uart, as far as the uart and the
+// writer policy allow, in framed mode only complete frames, and acks those that weren't acked
+// ahead so the sender's window opens up again. The buffer is drained in place, which takes at
+// most two writes if the data wraps around the end of the ring. It returns the number of chars
+// written.
+template<class Port>
+size_t SbrClient<Port>::rxBufToUart(size_t max) {
+    size_t written = 0;
+    if (sbr->_framing && max > rxFramed) max = rxFramed; // only write complete frames
+    while (max > 0 && !rxBuf.empty()) {
+        size_t w = rxBuf.contiguous();
+        if (w > max) w = max;
+        TRC(trSbrBufToUart, w);
+        size_t n = sbr->uartWrite(this, rxBuf.front(), w);
+        rxBuf.consume(n);
+        if (sbr->_framing) rxFramed -= n;
+        size_t pre = n < ahead ? n : ahead;
+        ahead -= pre;
+        ack(n - pre);
+        written += n;
+        if (n < w) break;
+        max -= n;
+    }
+    ackAhead();
+    return written;
+}
+
+// ackAhead acks the buffered chars that the uart is expected to drain soon, within the bridge's
+// ack-ahead budget, so the sender's window opens before the uart runs dry rather than after.
+template<class Port>
+void SbrClient<Port>::ackAhead() {
+    if (sbr->_ackAheadMax == 0 || !client || ws) return;
+    size_t target = sbr->uartDrain(this);
+    size_t avail = sbr->_framing ? rxFramed : rxBuf.used();
+    if (target > avail) target = avail;
+    if (target <= ahead) return;
+    ack(target - ahead);
+    stats.ackedAhead += target - ahead;
+    ahead = target;
+}
+
+// telnet protocol handling for RFC 2217 mode
+
+// telnetIn strips the telnet commands out of a packet received from the client and processes
+// them, it returns the length of the data that remains at the start of the packet. Runs of data
+// are moved with a single memmove each and only the commands are parsed a char at a time.
+template<class Port>
+size_t SbrClient<Port>::telnetIn(uint8_t *data, size_t len) {
+    using namespace sbr_detail;
+    uint8_t *out = data, *p = data, *end = data+len;
+    while (p < end) {
+        if (tnState == tnsData) {
+            uint8_t *iac = (uint8_t*)memchr(p, tnIAC, end-p);
+            size_t n = (iac ? iac : end) - p;
+            if (out != p) memmove(out, p, n);
+            out += n;
+            p += n;
+            if (iac) { tnState = tnsIac; p++; }
+            continue;
+        }
+        uint8_t c = *p++;
+        switch (tnState) {
+        case tnsIac:
+            tnState = tnsData;
+            if (c == tnIAC) *out++ = tnIAC; // escaped 0xFF data char
+            else if (c >= tnWILL) tnState = c;
+            else if (c == tnSB) { tnState = tnsSb; sbLen = 0; }
+            break; // other commands, such as NOP, are ignored
+        case tnsSb:
+            if (c == tnIAC) tnState = tnsSbIac;
+            else if (sbLen < sizeof(sbBuf)) sbBuf[sbLen++] = c;
+            break;
+        case tnsSbIac:
+            if (c == tnIAC) {
+                if (sbLen < sizeof(sbBuf)) sbBuf[sbLen++] = c;
+                tnState = tnsSb;
+                break;
+            }
+            tnState = tnsData;
+            if (c == tnSE && sbLen >= 2 && sbBuf[0] == tnoComPort)
+                sbr->comPortCmd(this, sbBuf[1], sbBuf+2, sbLen-2);
+            break;
+        default: // tnWILL..tnDONT
+            telnetOption(tnState, c);
+            tnState = tnsData;
+            break;
+        }
+    }
+    return out - data;
+}
+
+namespace sbr_detail {
+
+// tnOptBit returns the bit in tnOpts for an option enabled on the client's side (remote) or on
+// our side, or 0 if we don't support the option.
+static inline uint8_t tnOptBit(uint8_t opt, bool remote) {
+    switch (opt) {
+    case tnoBinary: return remote ? 0x01 : 0x10;
+    case tnoSGA: return remote ? 0x02 : 0x20;
+    case tnoComPort: return remote ? 0x04 : 0;
+    }
+    return 0;
+}
+
+} // namespace sbr_detail
+
+// telnetOption handles option negotiation: we agree to binary mode and suppress-go-ahead in both
+// directions and to the client's offer to use the COM port option, everything else is refused.
+// A reply is only sent if the option's state changes, which prevents negotiation loops.
+template<class Port>
+void SbrClient<Port>::telnetOption(uint8_t verb, uint8_t opt) {
+    using namespace sbr_detail;
+    bool remote = verb == tnWILL || verb == tnWONT;
+    bool enable = verb == tnWILL || verb == tnDO;
+    uint8_t bit = tnOptBit(opt, remote);
+    uint8_t reply = 0;
+    if (enable && bit == 0) {
+        reply = remote ? tnDONT : tnWONT;
+    } else if (enable && !(tnOpts & bit)) {
+        tnOpts |= bit;
+        reply = remote ? tnDO : tnWILL;
+    } else if (!enable && (tnOpts & bit)) {
+        tnOpts &= ~bit;
+        reply = remote ? tnDONT : tnWONT;
+    }
+    TRC(trSbrTelnet, verb, opt);
+    if (reply == 0) return;
+    uint8_t msg[3] = { tnIAC, reply, opt };
+    ctlPut(msg, 3);
+}
+
+// ctlPut queues a telnet response to be sent to the client. If the queue is full it's handed to
+// the TCP connection, so responses are only lost if the client floods us with commands without
+// reading the responses.
+template<class Port>
+void SbrClient<Port>::ctlPut(const uint8_t *data, size_t len) {
+    if (len > sizeof(ctlBuf) - ctlLen) ctlFlush();
+    if (len > sizeof(ctlBuf) - ctlLen) {
+        INFO(PSTR("[SERIAL_BRIDGE] telnet response overflow\n"));
+        return;
+    }
+    memcpy(ctlBuf+ctlLen, data, len);
+    ctlLen += len;
+}
+
+// comPortReply queues the response to a COM port command, escaping any IAC in the value.
+template<class Port>
+void SbrClient<Port>::comPortReply(uint8_t cmd, const uint8_t *val, size_t len) {
+    using namespace sbr_detail;
+    uint8_t msg[4+2*sizeof(sbBuf)+2] = { tnIAC, tnSB, tnoComPort, (uint8_t)(cmd+100) };
+    size_t n = 4;
+    for (size_t i=0; i<len && i<sizeof(sbBuf); i++) {
+        if (val[i] == tnIAC) msg[n++] = tnIAC;
+        msg[n++] = val[i];
+    }
+    msg[n++] = tnIAC;
+    msg[n++] = tnSE;
+    ctlPut(msg, n);
+}
+
+// ctlFlush hands queued responses to the TCP connection and returns true if none are left. The
+// responses are copied into the TCP send buffer and are interleaved with data sent straight out
+// of the tx ring, so their position in the stream is recorded for handleAck to skip over.
+template<class Port>
+bool SbrClient<Port>::ctlFlush() {
+    if (ctlLen == 0) return true;
+    if (!client || oobCnt == SBR_OOB_MAX) return false;
+    size_t n = copyOut((char*)ctlBuf, ctlLen);
+    if (n == 0) return false;
+    if (replaying) {
+        copied += n; // precedes all data sent from the ring
+    } else if (sbr->_lagPolicy != sbrDropOldest) { // drop-oldest copies everything, ignores acks
+        if (oobCnt > 0 && oobPos[oobCnt-1] == txNext) {
+            oobLen[oobCnt-1] += n;
+        } else {
+            oobPos[oobCnt] = txNext;
+            oobLen[oobCnt++] = n;
+        }
+    }
+    ctlLen -= n;
+    memmove(ctlBuf, ctlBuf+n, ctlLen);
+    return ctlLen == 0;
+}
+
+// copyOut queues a copy of up to len chars to be sent to the client and returns the number queued.
+// A WebSocket client gets them as one binary message, unless its queue is full.
+template<class Port>
+size_t SbrClient<Port>::copyOut(const char *data, size_t len) {
+    if (!ws) return client->add(data, len, ASYNC_WRITE_FLAG_COPY);
+    if (ws->queueIsFull()) return 0;
+    ws->binary((const uint8_t*)data, len);
+    lastActive = millis(); // there are no acks to go by
+    return len;
+}
+
+// client socket event handlers
+
+// handleError just prints a message and it is expected that ESPAsyncTCP also calls the
+// handleDisconnect callback.
+template<class Port>
+void SbrClient<Port>::handleError(int8_t error) {
+    INFO(PSTR("[SERIAL_BRIDGE] conn err client %s: %s\n"),
+        client->remoteIP().toString().c_str(),
+        client->errorToString(error));
+}
+
+// handleData receives a packet coming in on a TCP connection. It tries to stuff some characters
+// into the uart and has to buffer the rest. Only the characters stuffed into the uart are acked.
+template<class Port>
+void SbrClient<Port>::handleData(void *data, size_t len) {
+        using namespace sbr_detail;
+        stats.bytesIn += len;
+        lastActive = millis();
+        // in RFC 2217 mode strip telnet commands, which are acked right away, packets that are
+        // plain data, i.e. the vast majority, pass through untouched after a single memchr
+        size_t cmdLen = 0;
+        if (sbr->_telnet && (tnState != tnsData || memchr(data, tnIAC, len))) {
+            size_t n = telnetIn((uint8_t*)data, len);
+            cmdLen = len - n;
+            len = n;
+            if (ctlLen > 0 && ctlFlush()) client->send();
+            if (len == 0) return;
+        }
+        TRC(trSbrRx, len, rxBuf.used());
+        // in framed mode only the part of the packet up to the end of the last frame in it
+        // may be written, the rest has to wait for the remainder of its frame
+        size_t framed = len;
+        if (sbr->_framing)
+            framed = rxParser.scan((uint8_t*)data, len, sbr->_framing, sbr->_frameLenBytes);
+        // if we have buffered chars take this opportunity to stuff some into the uart
+        if (!rxBuf.empty()) rxBufToUart(SIZE_MAX);
+        // write what the uart and the writer policy allow, if that's all then we're done
+        size_t writable = rxBuf.empty() ? sbr->uartWrite(this, (uint8_t*)data, framed) : 0;
+        if (writable == len) {
+            TRC(trSbrWrAll, len);
+            return;
+        }
+        if (!ws) client->ackLater();
+        stats.ackLater++;
+        if (cmdLen > 0) ack(cmdLen);
+        if (writable > 0) {
+            TRC(trSbrWrSome, writable);
+            ack(writable);
+        }
+        // buffer what we couldn't write, the ring holds a full TCP window so this only falls
+        // short if the sender doesn't respect the window
+        TRC(trSbrBuffer, len-writable);
+        size_t n = rxBuf.put((uint8_t*)data+writable, len-writable);
+        if (rxBuf.used() > stats.rxBufHigh) stats.rxBufHigh = rxBuf.used();
+        if (sbr->_framing) {
+            if (framed > writable) rxFramed = rxBuf.used() - (len-framed);
+            // a frame that doesn't fit is garbage, pass it on so the client doesn't get stuck
+            if (rxBuf.used() - rxFramed >= sbr->_maxFrame) {
+                sbr->_stats.frameErrors++;
+                rxFramed = rxBuf.used();
+            }
+        }
+        if (n < len-writable) {
+            INFO(PSTR("[SERIAL_BRIDGE] rx buffer overflow, dropping %d\n"), len-writable-n);
+            stats.rxDropped += len-writable-n;
+            ack(len-writable-n);
+        }
+        ackAhead();
+}
+
+// handleAck receives notification that the client acked data. Data is normally sent straight out
+// of the tx ring without being copied, so this is what frees up space in the ring.
+template<class Port>
+void SbrClient<Port>::handleAck(size_t len) {
+    lastActive = millis();
+    if (sbr->_lagPolicy == sbrDropOldest) return; // data was copied, see txToClient
+    // the replayed history was copied and comes before the data sent from the ring
+    if (copied > 0) {
+        size_t n = len < copied ? len : copied;
+        copied -= n;
+        len -= n;
+    }
+    // skip over telnet responses, they were copied and are not in the ring
+    while (oobCnt > 0) {
+        size_t n = oobPos[0] - txAcked;
+        if (n >= len) break;
+        txAcked += n;
+        len -= n;
+        n = len < oobLen[0] ? len : oobLen[0];
+        oobLen[0] -= n;
+        len -= n;
+        if (oobLen[0] > 0) return;
+        oobCnt--;
+        memmove(oobPos, oobPos+1, oobCnt*sizeof(oobPos[0]));
+        memmove(oobLen, oobLen+1, oobCnt*sizeof(oobLen[0]));
+    }
+    txAcked += len;
+}
+
+// handleDisconnect receives notification that a connection has been terminated. It cannot fully
+// clean up the client struct because data may be pending in the buffer.
+template<class Port>
+void SbrClient<Port>::handleDisconnect() {
+        INFO(PSTR("[SERIAL_BRIDGE] client %s disconnect\n"),
+            client->remoteIP().toString().c_str());
+        if (!ws) delete client; // we own it once the server hands it to us
+        client = 0;
+        ws = 0;
+}
+
+// handleTimeout is called when the client hasn't acked data for the ack timeout, which means the
+// connection is broken, e.g. because the client's wifi dropped. It marks the client as dead and gc
+// closes the connection, which can't be done safely from within the callback.
+template<class Port>
+void SbrClient<Port>::handleTimeout(uint32_t time) {
+        INFO(PSTR("[SERIAL_BRIDGE] client %s TCP timeout after %dms\n"),
+            client->remoteIP().toString().c_str(), time);
+        dead = true;
+}
+
+// server socket event handlers
+
+template<class Port>
+static void _sbrHandleData(void* arg, AsyncClient* c, void *data, size_t len) {
+    ((SbrClient<Port>*)arg)->handleData(data, len);
+    ((SbrClient<Port>*)arg)->sbr->activate();
+}
+template<class Port>
+static void _sbrHandleAck(void* arg, AsyncClient* c, size_t len, uint32_t time) {
+    ((SbrClient<Port>*)arg)->handleAck(len);
+    ((SbrClient<Port>*)arg)->sbr->activate();
+}
+template<class Port>
+static void _sbrHandleError(void* arg, AsyncClient* c, int8_t error) {
+    ((SbrClient<Port>*)arg)->handleError(error);
+}
+template<class Port>
+static void _sbrHandleDisconnect(void* arg, AsyncClient* c) {
+    ((SbrClient<Port>*)arg)->handleDisconnect();
+}
+template<class Port>
+static void _sbrHandleTimeout(void* arg, AsyncClient* c, uint32_t time) {
+    ((SbrClient<Port>*)arg)->handleTimeout(time);
+}
+template<class Port>
+static void _sbrHandleNewClient(void* arg, AsyncClient* client) {
+    ((SerialBridgePort<Port>*)arg)->handleNewClient(client);
+}
+static inline void _sbrHandleRefused(void* arg, AsyncClient* c) {
+    delete c;
+}
+template<class Port>
+static void _sbrHandleDatagram(void* arg, AsyncUDPPacket& pkt) {
+    ((SerialBridgePort<Port>*)arg)->handleDatagram(pkt);
+    ((SerialBridgePort<Port>*)arg)->activate();
+}
+
+// newClient takes a client descriptor from the pool for a new TCP or WebSocket connection and adds
+// it to the fan-out. It returns null if the pool is empty.
+template<class Port>
+SbrClient<Port> *SerialBridgePort<Port>::newClient(AsyncClient* client, AsyncWebSocketClient *ws) {
+    INFO(PSTR("[SERIAL_BRIDGE] %s connect from %s\n"), ws ? "WebSocket" : "TCP",
+        client->remoteIP().toString().c_str());
+
+    // take a descriptor from the pool, its rx buffer is allocated on first use and kept for the
+    // next connection, so neither handleData nor a reconnecting client ever has to allocate
+    SbrClient<Port> *sbr_cli = _free;
+    if (sbr_cli == 0 || !sbr_cli->rxBuf.alloc(SBR_RXBUF_SZ + _ackAheadMax)) {
+        INFO(PSTR("[SERIAL_BRIDGE] %s, refusing %s\n"),
+            sbr_cli ? "out of memory" : "too many clients", client->remoteIP().toString().c_str());
+        _stats.refused++;
+        return 0;
+    }
+    _free = sbr_cli->nextFree;
+    SbrRing rxBuf = sbr_cli->rxBuf;
+    *sbr_cli = SbrClient<Port>();
+    sbr_cli->rxBuf = rxBuf;
+    sbr_cli->sbr = this;
+    sbr_cli->client = client;
+    sbr_cli->ws = ws;
+    sbr_cli->lastActive = millis();
+    // new clients start with live data, in framed mode at a frame boundary
+    sbr_cli->txNext = _framing ? _txFramePos : _txHead;
+    sbr_cli->txAcked = sbr_cli->txNext;
+    if (_hist) histStart(sbr_cli);
+    _clients.push_back(sbr_cli);
+    return sbr_cli;
+}
+
+// handleNewClient is called for a new TCP connection, which is refused by resetting it if the
+// client pool is empty.
+template<class Port>
+void SerialBridgePort<Port>::handleNewClient(AsyncClient* client) {
+    SbrClient<Port> *sbr_cli = newClient(client, 0);
+    if (sbr_cli == 0) {
+        client->onDisconnect(&_sbrHandleRefused, 0);
+        client->close(true);
+        return;
+    }
+
+    // register callbacks
+    client->onData(&_sbrHandleData<Port>, sbr_cli);
+    client->onAck(&_sbrHandleAck<Port>, sbr_cli);
+    client->onError(&_sbrHandleError<Port>, sbr_cli);
+    client->onDisconnect(&_sbrHandleDisconnect<Port>, sbr_cli);
+    client->onTimeout(&_sbrHandleTimeout<Port>, sbr_cli);
+    client->setAckTimeout(_ackTimeoutMs);
+#if LWIP_TCP_KEEPALIVE
+    // TCP keepalives detect dead connections that have nothing in flight
+    if (_keepAliveSec > 0) {
+        struct tcp_pcb *pcb = client->pcb();
+        pcb->so_options |= SOF_KEEPALIVE;
+        pcb->keep_idle = _keepAliveSec * 1000;
+        pcb->keep_intvl = 1000;
+        pcb->keep_cnt = 5;
+    }
+#endif
+
+    // let the application customize the client, e.g. setNoDelay(true)
+    if (_clientCB) (*_clientCB)(_clientCBArg, client);
+}
+
+// handleWebSocket handles the events of the WebSocket endpoint. A WebSocket client joins the same
+// fan-out as the TCP clients, but the WebSocket layer owns the TCP connection: the data sent to
+// the client is copied into binary messages, subject to the same lag policy when the client's
+// message queue is full, and the data received is acked by the WebSocket layer, so a client that
+// sends more than its rx buffer holds loses the excess.
+template<class Port>
+void SerialBridgePort<Port>::handleWebSocket(AsyncWebSocketClient *ws, AwsEventType type,
+        uint8_t *data, size_t len) {
+    SbrClient<Port> *cli = (SbrClient<Port>*)ws->_tempObject;
+    switch (type) {
+    case WS_EVT_CONNECT:
+        if (_telnet) {
+            INFO(PSTR("[SERIAL_BRIDGE] WebSocket doesn't support RFC 2217\n"));
+            ws->close();
+            return;
+        }
+        cli = newClient(ws->client(), ws);
+        if (cli == 0) ws->close();
+        ws->_tempObject = cli;
+        break;
+    case WS_EVT_DISCONNECT:
+        if (cli == 0) return;
+        ws->_tempObject = 0;
+        cli->handleDisconnect();
+        break;
+    case WS_EVT_DATA:
+        if (cli == 0 || cli->client == 0) return;
+        cli->handleData(data, len);
+        activate();
+        break;
+    default:
+        break;
+    }
+}
+
+template<class Port>
+static void _sbrUartPause(SerialBridgePort<Port> *sbr, bool paused) { sbr->uartPause(paused); }
+
+template<class Port>
+void SerialBridgePort<Port>::arbiter(UartArbiter &arb) {
+    arb.resident(&_sbrUartPause<Port>, this);
+}
+
+// uartPause is called by the arbiter when another user takes the uart and when it hands it back.
+// Before pausing, the chars in the uart's rx buffer are still fanned out to the clients. While
+// paused, the bridge leaves the uart alone, which the other user may reconfigure, e.g. run at a
+// different baud rate, so the bridge's baud rate and config are restored on resume. Pausing is
+// separate from disable(), so neither the arbiter nor the app undoes what the other did.
+template<class Port>
+void SerialBridgePort<Port>::uartPause(bool paused) {
+    TRC(trSbrPause, paused);
+    if (paused) {
+        if (!_active && !uartOff()) recvUartCheck(SIZE_MAX);
+        _paused = true;
+        INFO(PSTR("[SERIAL_BRIDGE] uart taken, pausing\n"));
+        return;
+    }
+    _port.begin(_baud, (SerialConfig)_uartConfig);
+    _paused = false;
+    INFO(PSTR("[SERIAL_BRIDGE] uart back, resuming at %d baud\n"), _baud);
+    activate();
+}
+
+// handleDatagram is called for each datagram received on the UDP port. It subscribes the sender
+// if it's new, updates its sequence counters, and writes the payload to the uart in one piece if
+// the uart has room for it and isn't held by a TCP client, otherwise the payload is dropped.
+template<class Port>
+void SerialBridgePort<Port>::handleDatagram(AsyncUDPPacket &pkt) {
+    if (pkt.length() < 2) return; // no sequence number, not for us
+    const uint8_t *data = pkt.data();
+    uint16_t seq = data[0] << 8 | data[1];
+    SbrUdpPeer *p = 0, *free = 0;
+    for (int i = 0; i < SBR_UDP_PEERS; i++) {
+        SbrUdpPeer &up = _udpPeers[i];
+        if (up.port == pkt.remotePort() && up.ip == pkt.remoteIP()) p = &up;
+        else if (up.port == 0 && free == 0) free = &up;
+    }
+    if (p == 0) {
+        if (free == 0) {
+            _stats.refused++;
+            return;
+        }
+        INFO(PSTR("[SERIAL_BRIDGE] UDP subscribe from %s:%d\n"),
+            pkt.remoteIP().toString().c_str(), pkt.remotePort());
+        p = free;
+        *p = SbrUdpPeer();
+        p->ip = pkt.remoteIP();
+        p->port = pkt.remotePort();
+        p->rxSeq = seq;
+        if (_udpSubs++ == 0) _udpNext = _framing ? _txFramePos : _txHead; // start with live data
+    }
+    // a datagram from before the expected one arrived late or twice, don't count it as a loss
+    uint16_t gap = seq - p->rxSeq;
+    if (gap < 0x8000) {
+        p->rxLost += gap;
+        p->rxSeq = seq + 1;
+    }
+    p->lastSeen = millis();
+    p->rxDatagrams++;
+    size_t len = pkt.length() - 2;
+    if (len == 0) return; // keepalive
+    if (uartOff() || (_writer && _writerPolicy != sbrWriteAny) || uartWritable() < (int)len) {
+        p->rxDropped++;
+        return;
+    }
+    _port.Port::write(data+2, len);
+}
+
+// udpSend sends the uart data that arrived since the last datagram to the UDP subscribers, as
+// long as there's a full datagram or the oldest char has waited for the flush delay. Each datagram
+// is copied into a pbuf by the UDP stack, so UDP never holds on to the tx ring.
+template<class Port>
+void SerialBridgePort<Port>::udpSend() {
+    uint32_t end = _framing ? _txFramePos : _txHead; // only complete frames in framed mode
+    if (_udpSubs == 0) {
+        _udpNext = end;
+        return;
+    }
+    uint32_t now = micros();
+    while ((int32_t)(end - _udpNext) > 0) {
+        size_t len = end - _udpNext;
+        if (len < _udpMax && now - _udpSince < _udpFlushUs) break; // wait for more
+        if (len > _udpMax) len = _udpMax;
+        // copy the chars out of the ring, which takes two copies if they wrap around
+        uint16_t rd = _udpNext & (_txSize-1);
+        size_t n = len;
+        if (n > (size_t)(_txSize - rd)) n = _txSize - rd;
+        memcpy(_udpBuf+2, _txBuf+rd, n);
+        memcpy(_udpBuf+2+n, _txBuf, len-n);
+        _udpBuf[0] = _udpSeq >> 8;
+        _udpBuf[1] = _udpSeq & 0xff;
+        for (int i = 0; i < SBR_UDP_PEERS; i++) {
+            SbrUdpPeer &up = _udpPeers[i];
+            if (up.port == 0) continue;
+            if (_udp->writeTo(_udpBuf, len+2, up.ip, up.port) == len+2) up.txDatagrams++;
+            else up.txFailed++;
+        }
+        _udpSeq++;
+        _udpNext += len;
+        _udpSince = now;
+    }
+}
+
+// periodic functions that keep things moving in the arduino loop()
+
+// txTail returns the position in the tx ring of the oldest byte that still has to be sent to, or
+// acked by, some client. If no client is connected it returns the head, i.e., the ring is empty.
+template<class Port>
+uint32_t SerialBridgePort<Port>::txTail() {
+    uint32_t tail = _txHead;
+    for (SbrClient<Port>* cli : _clients) {
+        if (!cli->client || cli->replaying) continue; // closed or not sending from the ring
+        if ((int32_t)(cli->txAcked - tail) < 0) tail = cli->txAcked;
+    }
+    if (_udpSubs > 0 && (int32_t)(_udpNext - tail) < 0) tail = _udpNext;
+    return tail;
+}
+
+// txMakeRoom applies the lag policy to clients whose backlog prevents need bytes from being
+// read into the tx ring. It returns the space available in the ring afterwards.
+template<class Port>
+size_t SerialBridgePort<Port>::txMakeRoom(size_t need) {
+    if (need > _txSize) need = _txSize;
+    uint32_t newTail = _txHead + need - _txSize; // all clients need to be at least here
+    for (SbrClient<Port>* cli : _clients) {
+        if (!cli->client || cli->replaying) continue; // closed or not sending from the ring
+        if ((int32_t)(newTail - cli->txAcked) <= 0) continue; // not lagging
+        if (_lagPolicy == sbrDisconnect) {
+            INFO(PSTR("[SERIAL_BRIDGE] client %s lagging, disconnecting\n"),
+                cli->client->remoteIP().toString().c_str());
+            cli->client->close(true); // calls handleDisconnect, which clears cli->client
+        } else {
+            if (!cli->lagging) {
+                INFO(PSTR("[SERIAL_BRIDGE] client %s lagging, dropping data\n"),
+                    cli->client->remoteIP().toString().c_str());
+            }
+            cli->lagging = true;
+            cli->stats.dropped += newTail - cli->txNext;
+            cli->txNext = cli->txAcked = newTail;
+        }
+    }
+    return _txSize - (_txHead - txTail());
+}
+
+// txToClient sends as much of the client's backlog as the TCP connection can take. The data is
+// not copied, LwIP references it in the tx ring until the client acks it. The exception is the
+// sbrDropOldest policy: a client that stops acking could pin the tail of the ring indefinitely, so
+// the data is copied into the TCP send buffer, which frees up the ring right away. Telnet
+// responses go out ahead of the backlog. In framed mode all complete frames go out in one send.
+template<class Port>
+void SerialBridgePort<Port>::txToClient(SbrClient<Port> *cli) {
+    if (cli->replaying) {
+        txReplay(cli);
+        return;
+    }
+    uint8_t flags = _lagPolicy == sbrDropOldest ? ASYNC_WRITE_FLAG_COPY : 0;
+    size_t sent = 0;
+    bool ctl = cli->ctlLen > 0;
+    uint32_t end = _framing ? _txFramePos : _txHead; // only complete frames in framed mode
+    while (cli->ctlFlush() && !cli->suspended && (int32_t)(end - cli->txNext) > 0) {
+        uint16_t rd = cli->txNext & (_txSize-1);
+        size_t len = end - cli->txNext;
+        if (len > (size_t)(_txSize - rd)) len = _txSize - rd; // don't wrap around
+        if (cli->ws && len > SBR_WS_MSG_MAX) len = SBR_WS_MSG_MAX;
+        size_t n = cli->ws ? cli->copyOut((char*)_txBuf+rd, len) :
+                cli->client->add((char*)_txBuf+rd, len, flags);
+        cli->txNext += n;
+        if (flags || cli->ws) cli->txAcked = cli->txNext;
+        sent += n;
+        if (n < len) break; // TCP send buffer is full
+    }
+    if (sent == 0 && !ctl) return;
+    cli->stats.bytesOut += sent;
+    if (end == cli->txNext) cli->lagging = false;
+    TRC(trSbrTx, sent, _txHead - cli->txNext);
+    if (!cli->send()) {
+        if (_stats.sendFailed++ == 0) INFO(PSTR("[SERIAL_BRIDGE] send failed\n"));
+    }
+}
+
+// txDue returns true if the client's backlog should be sent now according to the coalescing
+// policy: the backlog reached the byte count, it contains the flush char, the oldest char has
+// waited for the max delay, or the client asked for immediate sends using setNoDelay(true). In
+// framed mode the backlog is due as soon as it contains a complete frame.
+template<class Port>
+bool SerialBridgePort<Port>::txDue(SbrClient<Port> *cli) {
+    if (cli->ctlLen > 0) return true;
+    if (cli->replaying) return true;
+    if (_framing) return !cli->suspended && (int32_t)(_txFramePos - cli->txNext) > 0;
+    uint32_t pending = _txHead - cli->txNext;
+    if (pending == 0 || cli->suspended) return false;
+    if (pending >= _flushBytes || cli->client->getNoDelay()) return true;
+    if (_flushChar >= 0 && (int32_t)(_txFlushPos - cli->txNext) > 0) return true;
+    return micros() - cli->txSince >= _flushDelay;
+}
+
+// recvUartCheck checks whether something arrived on the uart and fans it out to the connected
+// clients, reading at most budget chars. Everything is read once into the shared tx ring and each
+// client has its own position in the ring, so each client drains at its own pace. When the ring
+// fills up the lag policy decides whether the slowest clients lose data, get disconnected, or hold
+// everyone up in which case the interrupt handler's buffer has to absorb the backlog.
+template<class Port>
+void SerialBridgePort<Port>::recvUartCheck(size_t budget) {
+    if (uartOff()) return;
+    if ((_clients.empty() && _hist == 0 && _udpSubs == 0) || _txBuf == 0) {
+        // no client connected, no UDP subscriber and no history, drop incoming chars on the
+        // floor, keeping track of the frames
+        int c;
+        while ((c = _port.Port::read()) != -1) {
+            uint8_t ch = c;
+            if (_framing == sbrLenPrefix) _txParser.scan(&ch, 1, _framing, _frameLenBytes);
+        }
+        _txFramePos = _txHead;
+        _port.Port::hasOverrun(); // clear flag in uart driver
+        _overrun = false;
+        return;
+    }
+    size_t avail = _port.Port::available();
+    if (avail > _stats.uartHigh) _stats.uartHigh = avail;
+    // count overruns, but only warn about the first one of a series
+    if (_port.Port::hasOverrun()) {
+        _stats.overruns++;
+        if (!_overrun) INFO(PSTR("[SERIAL_BRIDGE] uart input overrun\n"));
+        _overrun = true;
+    }
+    if (avail > budget) avail = budget;
+    if (avail == 0) {
+        _overrun = false;
+    } else {
+        // read from serial into the tx ring, making room according to the lag policy
+        size_t room = _txSize - (_txHead - txTail());
+        if (room < avail && _lagPolicy != sbrBlock) room = txMakeRoom(avail);
+        if (_telnet) room /= 2; // leave room to escape every char
+        if (room < avail) { TRC(trSbrTxRoom, room, avail); avail = room; }
+        // start the coalescing timer of clients that had no backlog
+        uint32_t now = micros();
+        for (SbrClient<Port>* cli : _clients) {
+            if (cli->txNext == _txHead) cli->txSince = now;
+        }
+        if (_udpNext == _txHead) _udpSince = now;
+        // read in bulk straight into the ring, this takes two reads if the space wraps around
+        while (avail > 0) {
+            uint16_t wr = _txHead & (_txSize-1);
+            size_t len = avail;
+            if (len > (size_t)(_txSize - wr)) len = _txSize - wr;
+            size_t n = _port.Port::read((char*)_txBuf+wr, len);
+            avail -= n;
+            if (n < len) avail = 0;
+            if (_telnet) n = txEscape(n);
+            if (_flushChar >= 0) txScanFlush(n);
+            if (_framing) txScanFrames(n);
+            if (_hist) histRecord(n);
+            _txHead += n;
+        }
+        // a frame that doesn't fit is garbage, pass it on so the clients don't get stuck
+        if (_framing && _txHead - _txFramePos >= _maxFrame) {
+            _stats.frameErrors++;
+            _txFramePos = _txHead;
+        }
+        uint16_t level = _txHead - txTail();
+        if (level > _stats.txRingHigh) _stats.txRingHigh = level;
+    }
+    // send backlog to each client that is due
+    for (SbrClient<Port>* cli : _clients) {
+        if (!cli->client) continue; // already closed
+        if (txDue(cli)) txToClient(cli);
+    }
+    if (_udp) udpSend();
+}
+
+// txEscape doubles the telnet IAC chars among the n chars just read into the ring at the head and
+// returns the resulting length. Chunks without IAC, i.e. the normal case, are left in place, others
+// are expanded backwards from the end so each char is moved once, wrapping around the end of the
+// ring if necessary. The caller guarantees that there is room for 2*n chars.
+template<class Port>
+size_t SerialBridgePort<Port>::txEscape(size_t n) {
+    using namespace sbr_detail;
+    uint8_t *p = _txBuf + (_txHead & (_txSize-1)), *end = p+n;
+    size_t iacs = 0;
+    while ((p = (uint8_t*)memchr(p, tnIAC, end-p)) != 0) { p++; iacs++; }
+    if (iacs == 0) return n;
+    uint16_t mask = _txSize-1;
+    uint32_t src = _txHead + n, dst = _txHead + n + iacs;
+    while (src != dst) {
+        uint8_t c = _txBuf[--src & mask];
+        _txBuf[--dst & mask] = c;
+        if (c == tnIAC) _txBuf[--dst & mask] = c;
+    }
+    return n + iacs;
+}
+
+// txScanFlush moves the flush position past the last flush char among the n chars at the head.
+template<class Port>
+void SerialBridgePort<Port>::txScanFlush(size_t n) {
+    uint32_t pos = _txHead;
+    while (n > 0) {
+        uint16_t rd = pos & (_txSize-1);
+        size_t len = n;
+        if (len > (size_t)(_txSize - rd)) len = _txSize - rd;
+        uint8_t *p = _txBuf+rd, *end = p+len;
+        while ((p = (uint8_t*)memchr(p, _flushChar, end-p)) != 0) {
+            p++;
+            _txFlushPos = pos + (p-(_txBuf+rd));
+        }
+        pos += len;
+        n -= len;
+    }
+}
+
+// txScanFrames moves the frame position past the last frame that ends among the n chars at the
+// head.
+template<class Port>
+void SerialBridgePort<Port>::txScanFrames(size_t n) {
+    uint32_t pos = _txHead;
+    while (n > 0) {
+        uint16_t rd = pos & (_txSize-1);
+        size_t len = n;
+        if (len > (size_t)(_txSize - rd)) len = _txSize - rd;
+        size_t end = _txParser.scan(_txBuf+rd, len, _framing, _frameLenBytes);
+        if (end > 0) _txFramePos = pos + end;
+        pos += len;
+        n -= len;
+    }
+}
+
+// histRecord copies the n chars just read into the tx ring at the head into the history and marks
+// the first line that starts among them with the time, at most one mark every SBR_HIST_MARK_MS.
+// In framed mode it marks the last frame boundary instead, so a replay starts with a whole frame.
+template<class Port>
+void SerialBridgePort<Port>::histRecord(size_t n) {
+    uint32_t pos = _txHead;
+    for (size_t left = n; left > 0; ) {
+        uint16_t hw = pos & (_histSize-1), tr = pos & (_txSize-1);
+        size_t len = left;
+        if (len > (size_t)(_histSize - hw)) len = _histSize - hw;
+        if (len > (size_t)(_txSize - tr)) len = _txSize - tr;
+        memcpy(_hist+hw, _txBuf+tr, len);
+        pos += len;
+        left -= len;
+    }
+    uint32_t ms = millis();
+    uint32_t last = (_histMarkCnt-1) % SBR_HIST_MARKS;
+    if (_histMarkCnt > 0 && ms - _histMarks[last].ms < SBR_HIST_MARK_MS) return;
+    uint32_t at = _txHead;
+    if (_framing) {
+        if ((int32_t)(_txFramePos - _txHead) <= 0) return; // no frame ends here
+        at = _txFramePos;
+    } else if (_txHead != _histBase && _hist[(_txHead-1) & (_histSize-1)] != '\n') {
+        // find the end of the current line, it's good enough to look at the first contiguous part
+        uint8_t *p = _txBuf + (_txHead & (_txSize-1));
+        size_t len = n;
+        size_t room = _txSize - (_txHead & (_txSize-1));
+        if (len > room) len = room;
+        uint8_t *nl = (uint8_t*)memchr(p, '\n', len);
+        if (nl == 0) return;
+        at = _txHead + (nl+1 - p);
+    }
+    SbrHistMark &m = _histMarks[_histMarkCnt++ % SBR_HIST_MARKS];
+    m.pos = at;
+    m.ms = ms;
+}
+
+// histOldest returns the position of the oldest char in the history.
+template<class Port>
+uint32_t SerialBridgePort<Port>::histOldest() {
+    return _txHead - _histBase > _histSize ? _txHead - _histSize : _histBase;
+}
+
+// histStart sets up a new client to be sent the history before the live data. The replay starts
+// at the oldest line that is still in the history and not older than the max age.
+template<class Port>
+void SerialBridgePort<Port>::histStart(SbrClient<Port> *cli) {
+    uint32_t oldest = histOldest(), live = _framing ? _txFramePos : _txHead, start = live;
+    uint32_t first = _histMarkCnt > SBR_HIST_MARKS ? _histMarkCnt - SBR_HIST_MARKS : 0;
+    uint32_t i;
+    for (i = first; i < _histMarkCnt; i++) {
+        SbrHistMark &m = _histMarks[i % SBR_HIST_MARKS];
+        if ((int32_t)(m.pos - oldest) < 0) continue;
+        if (_histMaxAge > 0 && millis() - m.ms > _histMaxAge) continue;
+        start = m.pos;
+        break;
+    }
+    if (i == first && _histMaxAge == 0 && !_framing) start = oldest; // also the partial line
+    if ((int32_t)(live - start) <= 0) return;
+    TRC(trSbrReplay, live - start);
+    cli->replaying = true;
+    cli->replayMark = i;
+    cli->txNext = cli->txAcked = start;
+}
+
+// txReplay sends a replaying client as much of the history as the TCP connection can take, with
+// each marked line prefixed with its timestamp if enabled. The history ring is overwritten as new
+// data arrives, so it's copied into the TCP send buffer and the client drops whatever gets
+// overwritten before it's sent. Once the client has caught up it switches to the live data in the
+// tx ring, so it never holds up the other clients.
+template<class Port>
+void SerialBridgePort<Port>::txReplay(SbrClient<Port> *cli) {
+    if (!cli->ctlFlush()) return;
+    uint32_t oldest = histOldest();
+    if ((int32_t)(cli->txNext - oldest) < 0) {
+        cli->stats.dropped += oldest - cli->txNext;
+        cli->txNext = oldest;
+    }
+    if (_histMarkCnt - cli->replayMark > SBR_HIST_MARKS) {
+        cli->replayMark = _histMarkCnt - SBR_HIST_MARKS;
+    }
+    uint32_t live = _framing ? _txFramePos : _txHead;
+    size_t sent = 0;
+    while ((int32_t)(live - cli->txNext) > 0) {
+        uint32_t end = live;
+        // skip marks that have been passed and insert the timestamp of the one we're at
+        while (cli->replayMark < _histMarkCnt) {
+            SbrHistMark &m = _histMarks[cli->replayMark % SBR_HIST_MARKS];
+            if ((int32_t)(m.pos - cli->txNext) > 0) {
+                if (_histStamps) end = m.pos;
+                break;
+            }
+            if (_histStamps && m.pos == cli->txNext) {
+                char stamp[16];
+                int n = snprintf(stamp, sizeof(stamp), "[%u.%03u] ", m.ms/1000, m.ms%1000);
+                if (!cli->ws && cli->client->space() < (size_t)n) break;
+                if (cli->copyOut(stamp, n) == 0) break;
+                cli->copied += n;
+                sent += n;
+            }
+            cli->replayMark++;
+        }
+        if (_histStamps && cli->replayMark < _histMarkCnt &&
+                _histMarks[cli->replayMark % SBR_HIST_MARKS].pos == cli->txNext) {
+            break; // no space for the timestamp
+        }
+        uint16_t rd = cli->txNext & (_histSize-1);
+        size_t len = end - cli->txNext;
+        if (len > (size_t)(_histSize - rd)) len = _histSize - rd; // don't wrap around
+        if (cli->ws && len > SBR_WS_MSG_MAX) len = SBR_WS_MSG_MAX;
+        size_t n = cli->copyOut((char*)_hist+rd, len);
+        cli->txNext += n;
+        cli->copied += n;
+        sent += n;
+        if (n < len) break; // TCP send buffer is full
+    }
+    if (cli->txNext == live) {
+        TRC(trSbrReplayDone);
+        cli->replaying = false;
+        cli->txAcked = live;
+        cli->txSince = micros();
+    }
+    if (sent == 0) return;
+    cli->stats.bytesOut += sent;
+    if (!cli->send()) {
+        if (_stats.sendFailed++ == 0) INFO(PSTR("[SERIAL_BRIDGE] send failed\n"));
+    }
+}
+
+// recvTCPCheck handles data that got received but couldn't be stuffed into the uart, writing at
+// most budget chars.
+template<class Port>
+void SerialBridgePort<Port>::recvTCPCheck(size_t budget) {
+    if (_writer) writerCheck();
+    // start with the client holding the uart so the others get it in turn
+    size_t n = _clients.size(), start = 0;
+    for (size_t i=0; i<n; i++) {
+        if (_clients[i] == _writer) start = i;
+    }
+    for (size_t i=0; i<n && budget > 0; i++) {
+        SbrClient<Port> *cli = _clients[(start+i) % n];
+        if (cli->rxBuf.empty()) continue;
+        //if (cli->client && cli->client->space() == 0) continue; // HACK!
+        if (uartWritable() <= 0) break;
+        // looks like we have something that we can write to the UART, so do it...
+        budget -= cli->rxBufToUart(budget);
+    }
+}
+
+// uartWrite writes up to len chars received from a client to the uart, as far as the uart and the
+// writer policy allow, and returns the number written. Except with sbrWriteAny the uart is granted
+// to one client at a time, which keeps it until it has written its quantum, with sbrWriteMessage
+// until the end of the message following that, and the uart is then passed to the next client.
+// In framed mode a message is a frame.
+template<class Port>
+size_t SerialBridgePort<Port>::uartWrite(SbrClient<Port> *cli, const uint8_t *data, size_t len) {
+    int writable = uartWritable();
+    if (writable <= 0) return 0;
+    if (len > (size_t)writable) len = writable;
+    if (_writerPolicy == sbrWriteAny) return _port.Port::write(data, len);
+    if (_writer == 0) {
+        _writer = cli;
+        _writerUsed = 0;
+        _writerLast = millis();
+    }
+    if (_writer != cli) return 0;
+    if (_writerPolicy == sbrWriteRoundRobin && len > (size_t)(_writerQuantum - _writerUsed)) {
+        len = _writerQuantum - _writerUsed;
+    } else if (_writerPolicy == sbrWriteMessage && _writerUsed >= _writerQuantum) {
+        size_t end;
+        if (_framing == sbrLenPrefix) {
+            SbrFrameParser p = cli->wrParser; // find the end without consuming the data
+            end = p.scan(data, len, _framing, _frameLenBytes, true);
+        } else {
+            const uint8_t *e = (const uint8_t*)memchr(data, _writerMsgEnd, len);
+            end = e ? e+1 - data : 0;
+        }
+        if (end) len = end;
+    }
+    size_t n = _port.Port::write(data, len);
+    if (n == 0) return 0;
+    _writerUsed += n;
+    _writerLast = millis();
+    if (_framing == sbrLenPrefix) {
+        cli->wrParser.scan(data, n, _framing, _frameLenBytes);
+        _writerAtEnd = cli->wrParser.atEnd();
+    } else {
+        _writerAtEnd = data[n-1] == _writerMsgEnd;
+    }
+    if (_writerUsed >= _writerQuantum && (_writerPolicy == sbrWriteRoundRobin ||
+            (_writerPolicy == sbrWriteMessage && _writerAtEnd))) {
+        writerPass();
+    }
+    return n;
+}
+
+// writerCheck passes the uart on when its holder has nothing left to write: right away with
+// sbrWriteRoundRobin or at the end of a message, otherwise after the lease time, so a client that
+// disappears in the middle of a message can't block the others forever.
+template<class Port>
+void SerialBridgePort<Port>::writerCheck() {
+    if (!_writer->rxBuf.empty()) return;
+    if (_writerPolicy == sbrWriteRoundRobin || !_writer->client ||
+            (_writerPolicy == sbrWriteMessage && _writerAtEnd) ||
+            millis() - _writerLast >= _writerLease) {
+        writerPass();
+    }
+}
+
+// writerPass passes the uart on to the next client with buffered data, if there is none it's up
+// for grabs by whichever client receives data next.
+template<class Port>
+void SerialBridgePort<Port>::writerPass() {
+    size_t n = _clients.size(), cur = 0;
+    for (size_t i=0; i<n; i++) {
+        if (_clients[i] == _writer) cur = i;
+    }
+    TRC(trSbrWriterPass, _writerUsed);
+    _writer = 0;
+    _writerUsed = 0;
+    _writerAtEnd = false;
+    _writerLast = millis();
+    for (size_t i=1; i<=n; i++) {
+        SbrClient<Port> *cli = _clients[(cur+i) % n];
+        if (!cli->rxBuf.empty()) {
+            _writer = cli;
+            break;
+        }
+    }
+}
+
+// uartWritable returns the number of chars that can be written to the uart without blocking. With
+// flow control that is zero while the device deasserts CTS, and it is zero while the bridge is
+// disabled, so client data is buffered and held back by TCP back-pressure.
+template<class Port>
+int SerialBridgePort<Port>::uartWritable() {
+    if (uartOff()) return 0;
+    if (_ctsPin >= 0 && _flowCtl && digitalRead(_ctsPin) != LOW) return 0;
+    return _port.Port::availableForWrite();
+}
+
+// uartDrain returns the number of chars of cli's buffer the uart is expected to write within the
+// ack horizon, estimated from the baud rate and capped by the ack-ahead budget. Nothing drains
+// while the uart can't be written, e.g. because CTS is deasserted or the bridge is paused, or while
+// another client holds the uart.
+template<class Port>
+size_t SerialBridgePort<Port>::uartDrain(SbrClient<Port> *cli) {
+    // the tx fifo is usually full when chars are buffered, what matters is whether it drains
+    if (uartOff() || (_ctsPin >= 0 && _flowCtl && digitalRead(_ctsPin) != LOW)) return 0;
+    if (_writer && _writer != cli && _writerPolicy != sbrWriteAny) return 0;
+    uint32_t drain = _baud/10 * _ackHorizonMs / 1000; // 10 bits per char
+    return drain < _ackAheadMax ? drain : _ackAheadMax;
+}
+
+// rtsCheck drives RTS with some hysteresis: it is deasserted when the uart rx buffer fills past
+// the high watermark or when the clients' backlog is about to fill the tx ring and the lag policy
+// blocks, and it is asserted again once both have drained below the low watermarks.
+template<class Port>
+void SerialBridgePort<Port>::rtsCheck() {
+    if (_rtsPin < 0 || !_flowCtl) return;
+    size_t level = uartOff() ? 0 : _port.Port::available();
+    size_t backlog = 0;
+    if (!uartOff() && _lagPolicy == sbrBlock) backlog = _txHead - txTail();
+    if (!_rtsStopped) {
+        if (level < _rtsHigh && backlog < (size_t)(_txSize - _txSize/4)) return;
+        _rtsStopped = true;
+        TRC(trSbrRtsOff, level, backlog);
+    } else {
+        if (level > _rtsLow || backlog > _txSize/2) return;
+        _rtsStopped = false;
+        TRC(trSbrRtsOn, level, backlog);
+    }
+    digitalWrite(_rtsPin, _rtsStopped ? HIGH : LOW);
+}
+
+// comPortCmd executes an RFC 2217 COM port command received from a client and queues the response,
+// which reports the resulting setting. Settings that can't be changed report the current one.
+template<class Port>
+void SerialBridgePort<Port>::comPortCmd(SbrClient<Port> *cli, uint8_t cmd, const uint8_t *val,
+        size_t len) {
+    using namespace sbr_detail;
+    uint8_t v = len > 0 ? val[0] : 0;
+    uint8_t rsp[4] = { v };
+    size_t rspLen = 1;
+    switch (cmd) {
+    case cpSignature: {
+        static const char sig[] = "esp-link";
+        cli->comPortReply(cmd, (const uint8_t*)sig, sizeof(sig)-1);
+        return; }
+    case cpSetBaudrate: {
+        if (len < 4) return;
+        uint32_t baud = (uint32_t)val[0]<<24 | (uint32_t)val[1]<<16 | val[2]<<8 | val[3];
+        if (baud > 0) {
+            INFO(PSTR("[SERIAL_BRIDGE] baud rate %d\n"), baud);
+            _baud = baud;
+            if (!uartOff()) _port.updateBaudRate(baud); // else applied when the uart is back
+        }
+        baud = _baud;
+        rsp[0] = baud>>24; rsp[1] = baud>>16; rsp[2] = baud>>8; rsp[3] = baud;
+        rspLen = 4;
+        break; }
+    case cpSetDatasize:
+    case cpSetParity:
+    case cpSetStopsize: {
+        // each of these is a field in the uart config, changing it requires a uart reset
+        static const uint8_t bits[] =
+            { UART_NB_BIT_5, UART_NB_BIT_6, UART_NB_BIT_7, UART_NB_BIT_8 };
+        static const uint8_t parity[] =
+            { UART_PARITY_NONE, UART_PARITY_ODD, UART_PARITY_EVEN };
+        static const uint8_t stop[] =
+            { UART_NB_STOP_BIT_1, UART_NB_STOP_BIT_2, UART_NB_STOP_BIT_15 };
+        const uint8_t *tab = cmd == cpSetDatasize ? bits : cmd == cpSetParity ? parity : stop;
+        uint8_t first = cmd == cpSetDatasize ? 5 : 1;
+        uint8_t cnt = cmd == cpSetDatasize ? 4 : 3;
+        uint8_t mask = cmd == cpSetDatasize ? UART_NB_BIT_MASK :
+                cmd == cpSetParity ? UART_PARITY_MASK : UART_NB_STOP_BIT_MASK;
+        if (v >= first && v < first+cnt && (_uartConfig & mask) != tab[v-first]) {
+            _uartConfig = (_uartConfig & ~mask) | tab[v-first];
+            INFO(PSTR("[SERIAL_BRIDGE] uart config 0x%02x\n"), _uartConfig);
+            // applied when the uart is back if it's paused or disabled
+            if (!uartOff()) _port.begin(_baud, (SerialConfig)_uartConfig);
+        }
+        for (v=0; v<cnt && tab[v] != (_uartConfig & mask); v++) ;
+        rsp[0] = v + first;
+        break; }
+    case cpSetControl:
+        switch (v) {
+        case 1: _flowCtl = false; break; // no flow control
+        case 3: _flowCtl = true; break;  // hardware flow control
+        case 5: case 6: uartBreak(v == 5); break;
+        case 8: case 9:
+            _dtrOn = v == 8;
+            if (_dtrPin >= 0) digitalWrite(_dtrPin, _dtrOn ? LOW : HIGH);
+            break;
+        case 11: case 12:
+            if (_rtsPin >= 0 && !_flowCtl) {
+                _rtsStopped = v == 12;
+                digitalWrite(_rtsPin, _rtsStopped ? HIGH : LOW);
+            }
+            break;
+        }
+        // report the state of the setting that was changed or queried
+        if (v <= 3) rsp[0] = _flowCtl && (_rtsPin >= 0 || _ctsPin >= 0) ? 3 : 1;
+        else if (v <= 6) rsp[0] = _breakOn ? 5 : 6;
+        else if (v <= 9) rsp[0] = _dtrOn ? 8 : 9;
+        else if (v <= 12) rsp[0] = _rtsStopped ? 12 : 11;
+        break;
+    case cpFlowSuspend:
+    case cpFlowResume:
+        cli->suspended = cmd == cpFlowSuspend;
+        return; // no response
+    case cpLinestateMask:
+    case cpModemstateMask:
+        break; // no notifications are sent, just acknowledge the mask
+    case cpPurgeData:
+        if ((v & 1) && !uartOff()) while (_port.Port::read() != -1) ;
+        if ((v & 2) && !cli->rxBuf.empty()) {
+            cli->ack(cli->rxBuf.used() - cli->ahead);
+            cli->rxBuf.clear();
+            cli->ahead = 0;
+        }
+        break;
+    default:
+        INFO(PSTR("[SERIAL_BRIDGE] unsupported COM port command %d\n"), cmd);
+        return;
+    }
+    cli->comPortReply(cmd, rsp, rspLen);
+}
+
+// uartBreak sets or clears the break condition on the uart's tx line.
+template<class Port>
+void SerialBridgePort<Port>::uartBreak(bool on) {
+    _breakOn = on;
+    if (uartOff()) return; // the uart belongs to someone else
+#ifdef UCBRK
+    // only the hardware uarts can send a break
+    int nr = (void*)&_port == (void*)&Serial ? 0 : (void*)&_port == (void*)&Serial1 ? 1 : -1;
+    if (nr < 0) return;
+    if (on) USC0(nr) |= 1<<UCBRK;
+    else USC0(nr) &= ~(1<<UCBRK);
+#endif
+}
+
+// gc closes the connections of clients that are dead or idle, garbage collects client
+// descriptors that have no connection and no buffer, and expires UDP subscribers. The data a
+// closed client left in its buffer is still written to the uart, except for an incomplete frame,
+// which is dropped.
+template<class Port>
+void SerialBridgePort<Port>::gc() {
+    uint32_t now = _idleMs ? millis() : 0;
+    for (size_t i = 0; i < _clients.size(); ) {
+        SbrClient<Port> *cli = _clients[i];
+        if (cli->client && (cli->dead || (_idleMs && now - cli->lastActive >= _idleMs))) {
+            INFO(PSTR("[SERIAL_BRIDGE] client %s %s, closing\n"),
+                cli->client->remoteIP().toString().c_str(), cli->dead ? "dead" : "idle");
+            cli->client->close(true); // calls handleDisconnect, which clears cli->client
+        }
+        if (!cli->client && _framing && cli->rxFramed == 0) cli->rxBuf.clear();
+        if (cli->client || !cli->rxBuf.empty()) {
+            i++; // client connected or buffer still has data
+            continue;
+        }
+        // no connection and no buffer: return the descriptor to the pool, moving the last client
+        // into its slot
+        if (_writer == cli) writerPass();
+        _clients[i] = _clients.back();
+        _clients.pop_back();
+        cli->nextFree = _free;
+        _free = cli;
+    }
+    // expire UDP subscribers that went quiet
+    for (int i = 0; i < SBR_UDP_PEERS && _udpSubs > 0; i++) {
+        SbrUdpPeer &up = _udpPeers[i];
+        if (up.port == 0 || millis() - up.lastSeen < SBR_UDP_EXPIRE_MS) continue;
+        INFO(PSTR("[SERIAL_BRIDGE] UDP %s:%d expired\n"), up.ip.toString().c_str(), up.port);
+        up.port = 0;
+        _udpSubs--;
+    }
+}
+
+// loop must be called from the arduino loop function to perform background tasks
+template<class Port>
+void SerialBridgePort<Port>::loop() {
+    uint32_t t0 = micros();
+    if (!_clients.empty()) TRC(trSbrLoop);
+    _active = true;
+    recvUartCheck(SIZE_MAX);
+    rtsCheck();
+    recvTCPCheck(SIZE_MAX);
+    gc();
+    _active = false;
+    if (!_clients.empty()) TRC(trSbrLoopEnd);
+    // histogram of loop durations, bucket i counts durations of 2^(i-1) up to 2^i-1 microseconds
+    uint32_t dt = micros() - t0;
+    int b = dt == 0 ? 0 : 32 - __builtin_clz(dt);
+    if (b >= SBR_LOOP_HIST) b = SBR_LOOP_HIST-1;
+    _stats.loopHist[b]++;
+}
+
+// activate services the bridge when an event signals that there is work, i.e., when a client sent
+// or acked data or when poll() detects uart activity. It only does a bounded amount of work so
+// it doesn't hog the cpu, whatever remains is picked up by the next event. It doesn't garbage
+// collect clients since it may be called from a client's callback.
+template<class Port>
+void SerialBridgePort<Port>::activate() {
+    if (_evBudget == 0 || _active) return;
+    _active = true;
+    TRC(trSbrActivate);
+    recvUartCheck(_evBudget);
+    rtsCheck();
+    recvTCPCheck(_evBudget);
+    TRC(trSbrActivateEnd);
+    _active = false;
+}
+
+template<class Port>
+static void _sbrPoll(SerialBridgePort<Port> *sbr) { sbr->poll(); }
+
+// poll is called periodically by a timer in event-driven mode and activates the bridge when the
+// uart rx buffer reaches the threshold, when chars below the threshold have sat there for a
+// couple of polls, when buffered chars can be written to the uart, or when a client has a backlog
+// that may be sendable.
+template<class Port>
+void SerialBridgePort<Port>::poll() {
+    if (_active) return;
+    size_t avail = uartOff() ? 0 : _port.Port::available();
+    bool work = avail >= _evThreshold || (avail > 0 && ++_evIdle >= 2);
+    for (SbrClient<Port>* cli : _clients) {
+        if (work) break;
+        if (!cli->rxBuf.empty()) work = uartWritable() > 0;
+        else if (cli->client && (cli->txNext != _txHead || cli->ctlLen > 0)) work = true;
+    }
+    if (_udpSubs > 0 && _udpNext != _txHead) work = true;
+    if (work) {
+        _evIdle = 0;
+        activate();
+    }
+    gc();
+}
+
+// stats copies the bridge-wide statistics
+template<class Port>
+void SerialBridgePort<Port>::stats(SbrStats &st) {
+    st = _stats;
+    st.clients = 0;
+    for (SbrClient<Port>* cli : _clients) {
+        if (cli->client) st.clients++;
+    }
+}
+
+// clientStats copies the statistics of up to max clients and returns the number copied. Clients
+// that have disconnected are included as long as they have buffered data.
+template<class Port>
+size_t SerialBridgePort<Port>::clientStats(SbrClientStats *st, size_t max) {
+    size_t n = 0;
+    for (SbrClient<Port>* cli : _clients) {
+        if (n == max) break;
+        st[n] = cli->stats;
+        st[n].connected = cli->client != 0;
+        if (cli->client) {
+            st[n].remoteIP = cli->client->remoteIP();
+            st[n].remotePort = cli->client->remotePort();
+        }
+        st[n].rxBuf = cli->rxBuf.used();
+        st[n].txBacklog = _txHead - cli->txNext;
+        n++;
+    }
+    return n;
+}
+
+// resetStats clears all counters and high-water marks, e.g. after they've been reported
+template<class Port>
+void SerialBridgePort<Port>::resetStats() {
+    memset(&_stats, 0, sizeof(_stats));
+    for (SbrClient<Port>* cli : _clients) {
+        cli->stats = SbrClientStats();
+    }
+}
+
+template<class Port>
+void SerialBridgePort<Port>::debug(void dbgPrintf(const char*, ...)) {
+    _debug = dbgPrintf;
+}
+
+template<class Port>
+void SerialBridgePort<Port>::backlog(uint16_t size, SbrLagPolicy policy) {
+    uint16_t sz = 64;
+    while (sz < size && sz < 0x8000) sz <<= 1;
+    _txSize = sz;
+    _lagPolicy = policy;
+}
+
+template<class Port>
+void SerialBridgePort<Port>::coalesce(uint16_t bytes, uint32_t delayUs, int16_t flushChar) {
+    _flushBytes = bytes > 0 ? bytes : 1;
+    _flushDelay = delayUs;
+    _flushChar = flushChar;
+}
+
+template<class Port>
+void SerialBridgePort<Port>::ackAhead(uint16_t maxBytes, uint16_t horizonMs) {
+    // the rx buffer, SBR_RXBUF_SZ + maxBytes, must fit in SbrRing's 16-bit size
+    uint32_t max = 0xFFFF - SBR_RXBUF_SZ;
+    _ackAheadMax = maxBytes < max ? maxBytes : max;
+    _ackHorizonMs = horizonMs < 1000 ? horizonMs : 1000;
+}
+
+template<class Port>
+void SerialBridgePort<Port>::eventDriven(uint16_t rxThreshold, uint16_t budget, uint8_t pollMs) {
+    _evThreshold = rxThreshold > 0 ? rxThreshold : 1;
+    _evBudget = budget;
+    _evPollMs = pollMs > 0 ? pollMs : 1;
+}
+
+template<class Port>
+void SerialBridgePort<Port>::writers(SbrWriterPolicy policy, uint16_t quantum, uint8_t msgEnd,
+        uint16_t leaseMs) {
+    _writerPolicy = policy;
+    _writerQuantum = quantum > 0 ? quantum : 1;
+    _writerMsgEnd = msgEnd;
+    _writerLease = leaseMs;
+    _writer = 0;
+}
+
+template<class Port>
+void SerialBridgePort<Port>::framing(SbrFraming mode, uint16_t maxFrame, uint8_t lenBytes) {
+    _framing = mode;
+    _maxFrame = maxFrame;
+    _frameLenBytes = lenBytes == 1 ? 1 : 2;
+}
+
+template<class Port>
+void SerialBridgePort<Port>::history(uint16_t size, uint32_t maxAgeMs, bool timestamps) {
+    uint16_t sz = 64;
+    while (sz < size && sz < 0x8000) sz <<= 1;
+    _histSize = size > 0 ? sz : 0;
+    _histMaxAge = maxAgeMs;
+    _histStamps = timestamps;
+}
+
+template<class Port>
+void SerialBridgePort<Port>::timeouts(uint32_t idleMs, uint32_t ackMs, uint16_t keepAliveSec) {
+    _idleMs = idleMs;
+    _ackTimeoutMs = ackMs;
+    _keepAliveSec = keepAliveSec;
+}
+
+template<class Port>
+void SerialBridgePort<Port>::webSocket(AsyncWebSocket &ws) {
+    ws.onEvent([this](AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type,
+            void *arg, uint8_t *data, size_t len) { handleWebSocket(client, type, data, len); });
+}
+
+template<class Port>
+void SerialBridgePort<Port>::udp(uint16_t port, uint16_t maxDatagram, uint32_t flushUs) {
+    _udpPort = port;
+    _udpMax = maxDatagram;
+    _udpFlushUs = flushUs;
+}
+
+// udpStats copies the statistics of up to max UDP subscribers and returns the number copied.
+template<class Port>
+size_t SerialBridgePort<Port>::udpStats(SbrUdpPeer *st, size_t max) {
+    size_t n = 0;
+    for (int i = 0; i < SBR_UDP_PEERS && n < max; i++) {
+        if (_udpPeers[i].port != 0) st[n++] = _udpPeers[i];
+    }
+    return n;
+}
+
+template<class Port>
+void SerialBridgePort<Port>::maxClients(uint8_t max) {
+    _maxClients = max > 0 ? max : 1;
+}
+
+template<class Port>
+void SerialBridgePort<Port>::rfc2217(int8_t dtrPin) {
+    _telnet = true;
+    _dtrPin = dtrPin;
+}
+
+template<class Port>
+void SerialBridgePort<Port>::begin(uint16_t port, uint32_t baudrate, uint32_t rxBufSz,
+        int8_t rtsPin, int8_t ctsPin) {
+    // allocate the shared tx ring, by default big enough for a full send buffer in flight
+    if (_txSize == 0) backlog(2*TCP_SND_BUF, _lagPolicy);
+    if (_txBuf) free(_txBuf);
+    _txBuf = (uint8_t *)malloc(_txSize);
+    _txHead = 0;
+    _txFlushPos = 0;
+    _txFramePos = 0;
+    _txParser = SbrFrameParser();
+    if (_txBuf == 0) INFO(PSTR("[SERIAL_BRIDGE] out of memory for tx ring\n"));
+
+    // allocate the history and its marks
+    if (_hist) free(_hist);
+    _hist = 0;
+    if (_histSize > 0) {
+        _hist = (uint8_t *)malloc(_histSize + SBR_HIST_MARKS*sizeof(SbrHistMark));
+        if (_hist == 0) INFO(PSTR("[SERIAL_BRIDGE] out of memory for history\n"));
+        _histMarks = (SbrHistMark *)(_hist + _histSize);
+    }
+    _histBase = _txHead;
+    _histMarkCnt = 0;
+
+    // init port
+    _port.setRxBufferSize(rxBufSz);
+    _uartConfig = SERIAL_8N1;
+    _baud = baudrate;
+    _port.begin(baudrate, (SerialConfig)_uartConfig);
+
+    // init flow control, RTS and CTS are active low
+    _rtsPin = rtsPin;
+    _ctsPin = ctsPin;
+    _rtsHigh = rxBufSz - rxBufSz/4;
+    _rtsLow = rxBufSz/4;
+    _rtsStopped = false;
+    if (_rtsPin >= 0) {
+        pinMode(_rtsPin, OUTPUT);
+        digitalWrite(_rtsPin, LOW);
+    }
+    if (_ctsPin >= 0) pinMode(_ctsPin, INPUT);
+    _flowCtl = true;
+    _breakOn = false;
+    _dtrOn = true;
+    if (_dtrPin >= 0) {
+        pinMode(_dtrPin, OUTPUT);
+        digitalWrite(_dtrPin, LOW);
+    }
+
+    // in framed mode frames must not be split by the lag policy or mixed by the writer policy, and
+    // they must fit in the tx ring and the clients' rx buffers
+    if (_framing) {
+        if (_telnet) {
+            INFO(PSTR("[SERIAL_BRIDGE] framed mode doesn't support RFC 2217\n"));
+            _telnet = false;
+        }
+        if (_maxFrame > _txSize/2) _maxFrame = _txSize/2;
+        if (_maxFrame > SBR_RXBUF_SZ) _maxFrame = SBR_RXBUF_SZ;
+        if (_writerPolicy == sbrWriteAny) _writerQuantum = 1;
+        if (_writerPolicy != sbrWriteExclusive) _writerPolicy = sbrWriteMessage;
+        if (_framing == sbrSlip) _writerMsgEnd = sbr_detail::SLIP_END;
+        _histStamps = false;
+    }
+
+    // allocate the client descriptor pool, the clients' rx buffers are allocated as they connect
+    for (SbrClient<Port> *cli : _clients) {
+        if (cli->client) cli->client->close(true);
+    }
+    _clients.clear();
+    if (_pool) {
+        for (int i = 0; i < _poolSize; i++) _pool[i].rxBuf.release();
+        free(_pool);
+    }
+    _pool = (SbrClient<Port> *)calloc(_maxClients, sizeof(SbrClient<Port>));
+    _poolSize = _pool ? _maxClients : 0;
+    if (_pool == 0) INFO(PSTR("[SERIAL_BRIDGE] out of memory for clients\n"));
+    _free = 0;
+    for (int i = _poolSize-1; i >= 0; i--) {
+        _pool[i].nextFree = _free;
+        _free = &_pool[i];
+    }
+    _clients.reserve(_poolSize);
+    _writer = 0;
+
+    // start the UDP transport, the datagrams are built in a buffer allocated once here
+    if (_udpPort && _telnet) {
+        INFO(PSTR("[SERIAL_BRIDGE] UDP doesn't support RFC 2217\n"));
+        _udpPort = 0;
+    }
+    if (_udp) delete _udp;
+    if (_udpBuf) free(_udpBuf);
+    _udp = 0;
+    _udpBuf = 0;
+    _udpSubs = 0;
+    for (int i = 0; i < SBR_UDP_PEERS; i++) _udpPeers[i] = SbrUdpPeer();
+    if (_udpPort) {
+        if (_udpMax > _txSize/2) _udpMax = _txSize/2;
+        _udpBuf = (uint8_t *)malloc(_udpMax + 2);
+        _udp = new AsyncUDP();
+        if (_udpBuf == 0 || !_udp->listen(_udpPort)) {
+            INFO(PSTR("[SERIAL_BRIDGE] can't start UDP on port %d\n"), _udpPort);
+            delete _udp;
+            _udp = 0;
+        } else {
+            _udp->onPacket(&_sbrHandleDatagram<Port>, this);
+        }
+    }
+
+    if (_evBudget > 0) _ticker.attach_ms(_evPollMs, &_sbrPoll<Port>, this);
+    AsyncServer* server = new AsyncServer(port);
+    server->onClient(&_sbrHandleNewClient<Port>, this);
+    server->begin();
+    INFO(PSTR("[SERIAL_BRIDGE] listening on port %d, baud rate %d\n"), port, baudrate);
+}
+
+#undef INFO
+#undef TRC
+#undef SBR_OOB_MAX
+
+#endif // SerialBridgeImpl_h
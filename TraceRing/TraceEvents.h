@@ -0,0 +1,50 @@
+// Esp-link-v4 Trace Ring
+// Copyright (C) 2018 by Throsten von Eicken
+
+// TraceEvents.h lists the trace events of all the libraries. It is shared by the device code and
+// host/tracedump, which prints each event using its format, with the event's two arguments in
+// that order. The ids are positions in the list, so new events must be appended at the end of
+// the whole list, not of their library's section, or traces captured with older builds would no
+// longer decode.
+
+#ifndef TraceEvents_h
+#define TraceEvents_h
+
+#define TRACE_EVENTS(X) \
+    X(trNone,           "") \
+    /* SerialBridge */ \
+    X(trSbrLoop,        "{") \
+    X(trSbrLoopEnd,     "}") \
+    X(trSbrActivate,    "[") \
+    X(trSbrActivateEnd, "]") \
+    X(trSbrRx,          "rx<%u/%u>") \
+    X(trSbrWrAll,       "wr{%u}") \
+    X(trSbrWrSome,      "wr[%u]") \
+    X(trSbrBuffer,      "buf<%u>") \
+    X(trSbrBufToUart,   "wr<%u>") \
+    X(trSbrTx,          "tx<%u/%u>") \
+    X(trSbrTxRoom,      "tx{%u/%u}") \
+    X(trSbrWriterPass,  "wp<%u>") \
+    X(trSbrRtsOff,      "rts<%u/%u>") \
+    X(trSbrRtsOn,       "rts>%u/%u<") \
+    X(trSbrTelnet,      "telnet %u %u") \
+    X(trSbrReplay,      "replay %u") \
+    X(trSbrReplayDone,  "replay done") \
+    X(trSbrPause,       "uart paused %u") \
+    /* AVRFlash */ \
+    X(trAvrSync,        "avr sync #%u @%u baud") \
+    X(trAvrBaud,        "avr attempt %u @%u baud") \
+    X(trAvrNoSync,      "avr no sync #%u @%u baud") \
+    X(trAvrInSync,      "avr in sync") \
+    X(trAvrPage,        "avr page %u@0x%x") \
+    X(trAvrPageDone,    "avr page done") \
+    X(trAvrError,       "avr error in state %u") \
+    X(trAvrDone,        "avr done") \
+    /* HexRecord */ \
+    X(trHexBase,        "hex record %02x sets base 0x%x")
+
+#define TRACE_ENUM(id, fmt) id,
+enum TraceEvent { TRACE_EVENTS(TRACE_ENUM) trNumEvents };
+#undef TRACE_ENUM
+
+#endif // TraceEvents_h
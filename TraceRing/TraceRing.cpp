@@ -0,0 +1,100 @@
+// Esp-link-v4 Trace Ring
+// Copyright (C) 2018 by Throsten von Eicken
+
+#include "TraceRing.h"
+
+TraceRing traceRing;
+
+// begin allocates a ring of size records, rounded up to a power of 2, and starts recording.
+void TraceRing::begin(uint16_t size) {
+    _on = false;
+    if (_buf) free(_buf);
+    uint16_t sz = 64;
+    while (sz < size && sz < 0x8000) sz <<= 1;
+    _buf = (TraceRec *)malloc(sz*sizeof(TraceRec));
+    _mask = _buf ? sz-1 : 0;
+    _head = 0;
+    _on = _buf != 0;
+}
+
+// header fills in the header of a dump of the records in the ring.
+void TraceRing::header(TraceHdr &hdr) {
+    hdr.magic = TRACE_MAGIC;
+    hdr.recSize = sizeof(TraceRec);
+    hdr.events = trNumEvents;
+    hdr.count = _buf == 0 ? 0 : _head > _mask ? _mask+1 : _head;
+    hdr.lost = _head - hdr.count;
+}
+
+static void _trHandleClient(void *arg, AsyncClient *client) {
+    ((TraceRing*)arg)->handleClient(client);
+}
+static void _trHandleAck(void *arg, AsyncClient *client, size_t len, uint32_t time) {
+    ((TraceRing*)arg)->handleAck(len);
+}
+static void _trHandleDisconnect(void *arg, AsyncClient *client) {
+    ((TraceRing*)arg)->handleDisconnect();
+}
+static void _trHandleRefused(void *arg, AsyncClient *client) {
+    delete client;
+}
+
+// serve starts a TCP server on port that sends a dump to each client that connects.
+void TraceRing::serve(uint16_t port) {
+    if (_server) return;
+    _server = new AsyncServer(port);
+    _server->onClient(&_trHandleClient, this);
+    _server->begin();
+}
+
+// handleClient starts sending a dump to a new client, or refuses it if another one is in
+// progress. The records are sent straight from the ring, which is frozen until the client
+// disconnects.
+void TraceRing::handleClient(AsyncClient *client) {
+    if (_client) {
+        client->onDisconnect(&_trHandleRefused, 0);
+        client->close(true);
+        return;
+    }
+    _client = client;
+    _wasOn = _on;
+    _on = false;
+    TraceHdr hdr;
+    header(hdr);
+    _pos = _head - hdr.count;
+    _end = _head;
+    _unacked = sizeof(hdr) + hdr.count*sizeof(TraceRec);
+    client->onAck(&_trHandleAck, this);
+    client->onDisconnect(&_trHandleDisconnect, this);
+    client->add((const char*)&hdr, sizeof(hdr), ASYNC_WRITE_FLAG_COPY);
+    sendMore();
+}
+
+// sendMore adds as many records as fit in the TCP send buffer, the connection is closed once the
+// whole dump has been acked.
+void TraceRing::sendMore() {
+    while (_pos != _end) {
+        uint32_t i = _pos & _mask;
+        uint32_t n = _end - _pos;
+        if (n > _mask+1 - i) n = _mask+1 - i; // don't wrap around
+        size_t space = _client->space() / sizeof(TraceRec);
+        if (n > space) n = space;
+        if (n == 0) break;
+        _client->add((const char*)(_buf+i), n*sizeof(TraceRec), 0);
+        _pos += n;
+    }
+    _client->send();
+}
+
+void TraceRing::handleAck(size_t len) {
+    _unacked -= len < _unacked ? len : _unacked;
+    if (_unacked == 0) _client->close();
+    else sendMore();
+}
+
+// handleDisconnect ends the dump and resumes recording.
+void TraceRing::handleDisconnect() {
+    delete _client;
+    _client = 0;
+    _on = _wasOn;
+}
@@ -0,0 +1,109 @@
+// Esp-link-v4 Trace Ring
+// Copyright (C) 2018 by Throsten von Eicken
+
+// The TraceRing library records binary trace events for diagnosing timing problems, such as the
+// stop-and-go stalls of the serial bridge. Each event is a fixed-size record with a timestamp in
+// micros(), an event id and two arguments, written to a ring in RAM that keeps the most recent
+// events. Nothing is formatted on the device: recording an event costs a branch while tracing is
+// off and a few stores while it's on, so it can be left on in production without changing the
+// timing being traced.
+//
+// The ring can be dumped to the serial port, or to anything else with a write(buf, len) method,
+// and fetched over TCP from the port passed to serve. host/tracedump turns a dump into a timeline
+// using the formats in TraceEvents.h. A dump is a TraceHdr followed by the records, oldest first,
+// in the esp8266's byte order, i.e. little-endian. Recording is paused while a dump is in progress
+// so the ring doesn't change under it.
+
+#ifndef TraceRing_h
+#define TraceRing_h
+
+#include <Arduino.h>
+#include "ESPAsyncTCP.h"
+#include "TraceEvents.h"
+
+#define TRACE_MAGIC 0x31435254 // "TRC1"
+
+// TraceRec is one event.
+struct TraceRec {
+    uint32_t us;        // time in micros()
+    uint16_t ev;        // event id, see TraceEvents.h
+    uint16_t a;         // first argument
+    uint32_t b;         // second argument
+};
+
+// TraceHdr starts a dump.
+struct TraceHdr {
+    uint32_t magic;     // TRACE_MAGIC
+    uint16_t recSize;   // sizeof(TraceRec)
+    uint16_t events;    // number of event ids known to the device
+    uint32_t count;     // number of records that follow
+    uint32_t lost;      // number of records overwritten before the dump
+};
+
+struct TraceRing {
+    TraceRing() : _on(false), _buf(0), _mask(0), _head(0), _server(0), _client(0),
+        _wasOn(false), _pos(0), _end(0), _unacked(0) {}
+
+    // begin allocates a ring of size records, rounded up to a power of 2, and starts recording.
+    void begin(uint16_t size);
+    // enable turns recording on or off, the ring keeps its content.
+    void enable(bool on) { _on = on && _buf; }
+    // serve starts a TCP server on port that sends a dump to each client that connects and then
+    // closes the connection, one client at a time.
+    void serve(uint16_t port);
+
+    // dump writes a dump to out, e.g. Serial.
+    template<class Out>
+    void dump(Out &out) {
+        bool on = _on;
+        _on = false;
+        TraceHdr hdr;
+        header(hdr);
+        out.write((const uint8_t*)&hdr, sizeof(hdr));
+        for (uint32_t pos = _head - hdr.count; pos != _head; ) {
+            uint32_t i = pos & _mask;
+            uint32_t n = _head - pos;
+            if (n > _mask+1 - i) n = _mask+1 - i; // don't wrap around
+            out.write((const uint8_t*)(_buf+i), n*sizeof(TraceRec));
+            pos += n;
+        }
+        _on = on;
+    }
+
+    // put records an event, use trace() instead.
+    void put(uint16_t ev, uint32_t a, uint32_t b) {
+        TraceRec &r = _buf[_head++ & _mask];
+        r.us = micros();
+        r.ev = ev;
+        r.a = a;
+        r.b = b;
+    }
+
+    // private
+
+    void header(TraceHdr &hdr);
+    void handleClient(AsyncClient *client);
+    void handleAck(size_t len);
+    void handleDisconnect();
+    void sendMore();
+
+    bool _on;                   // recording
+    TraceRec *_buf;             // the ring
+    uint32_t _mask;             // size of the ring - 1
+    uint32_t _head;             // number of records ever recorded
+    AsyncServer *_server;
+    AsyncClient *_client;       // client being sent a dump
+    bool _wasOn;                // recording was on before the dump
+    uint32_t _pos, _end;        // records of the dump left to send
+    uint32_t _unacked;          // bytes of the dump not acked yet
+};
+
+// traceRing is the ring shared by all the libraries.
+extern TraceRing traceRing;
+
+// trace records an event in the trace ring if recording is on.
+static inline void trace(uint16_t ev, uint32_t a=0, uint32_t b=0) {
+    if (traceRing._on) traceRing.put(ev, a, b);
+}
+
+#endif // TraceRing_h
@@ -0,0 +1,56 @@
+// Esp-link-v4 Uart Arbiter
+// Copyright (C) 2018 by Throsten von Eicken
+
+// UartArbiter decides who owns a uart. The resident user, typically the serial bridge, has the
+// uart whenever nobody else holds it. Another user, e.g. AVRFlash, takes it for the duration of
+// an operation: take pauses the resident before it returns, so from then on the uart belongs to
+// the taker alone, and release hands it back to the resident, which is then expected to restore
+// its own baud rate and settings. A second taker is turned away until the first one releases the
+// uart.
+//
+// All of this runs in the loop or in timer callbacks, which don't preempt each other, so the
+// ownership is a plain pointer.
+
+#ifndef UartArbiter_h
+#define UartArbiter_h
+
+struct UartArbiter {
+    UartArbiter() : _owner(0), _residentCB(0), _residentArg(0) {}
+
+    // resident registers the resident user's callback, which is called with paused set when
+    // another user takes the uart and with paused cleared when that user releases it.
+    template< typename ARG >
+    void resident(void (*cb)(ARG, bool paused), ARG cbArg) {
+        _residentCB = (void(*)(void*, bool))cb;
+        _residentArg = (void *)cbArg;
+    }
+
+    // take makes owner the exclusive user of the uart, pausing the resident, and returns true,
+    // or returns false if another owner already holds the uart.
+    bool take(const void *owner) {
+        if (_owner) return _owner == owner;
+        _owner = owner;
+        if (_residentCB) (*_residentCB)(_residentArg, true);
+        return true;
+    }
+
+    // release hands the uart back to the resident if owner holds it.
+    void release(const void *owner) {
+        if (_owner == 0 || _owner != owner) return;
+        _owner = 0;
+        if (_residentCB) (*_residentCB)(_residentArg, false);
+    }
+
+    // held returns true while a user other than the resident holds the uart.
+    bool held() const { return _owner != 0; }
+    // heldBy returns true while owner holds the uart.
+    bool heldBy(const void *owner) const { return _owner != 0 && _owner == owner; }
+
+    // private
+
+    const void *_owner;              // current owner, null when the resident has the uart
+    void (*_residentCB)(void*, bool);
+    void *_residentArg;
+};
+
+#endif // UartArbiter_h
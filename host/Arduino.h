@@ -0,0 +1,59 @@
+// Esp-link-v4 host build
+// Copyright (C) 2018 by Throsten von Eicken
+
+// Arduino.h is a stand-in for the esp8266 Arduino core that allows the libraries in this repo to
+// be compiled and exercised on Linux. Time is simulated, see sim.h.
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <string>
+#include <functional>
+
+#define PSTR(s) (s)
+#define ICACHE_RAM_ATTR
+#define ICACHE_FLASH_ATTR
+
+#define LOW    0
+#define HIGH   1
+#define INPUT  0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+void yield();
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+
+struct String : std::string {
+    String() {}
+    String(const char *s) : std::string(s) {}
+    String(const std::string &s) : std::string(s) {}
+};
+
+struct IPAddress {
+    IPAddress(uint32_t a=0) : _addr(a) {}
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : _addr(a|b<<8|c<<16|(uint32_t)d<<24) {}
+    operator uint32_t() const { return _addr; }
+    String toString() const {
+        char buf[16];
+        snprintf(buf, sizeof(buf), "%d.%d.%d.%d", _addr&0xff, (_addr>>8)&0xff, (_addr>>16)&0xff,
+                _addr>>24);
+        return String(buf);
+    }
+    uint32_t _addr;
+};
+
+#include "HardwareSerial.h"
+
+#endif // Arduino_h
@@ -0,0 +1,132 @@
+// Esp-link-v4 host build
+// Copyright (C) 2018 by Throsten von Eicken
+
+// ESPAsyncTCP.h is a stand-in for the ESPAsyncTCP library. Each AsyncClient is connected to a
+// simulated peer across a network with a fixed latency. The model follows LwIP where it matters
+// for the serial bridge: a send buffer of TCP_SND_BUF bytes, a receive window of TCP_WND bytes
+// that only opens up as the application acks data, delayed acks, window update thresholds, and
+// Nagle's algorithm.
+
+#ifndef ESPAsyncTCP_h
+#define ESPAsyncTCP_h
+
+#include "Arduino.h"
+
+namespace sim { extern uint32_t mss; struct Peer; }
+
+#define TCP_MSS     (sim::mss)
+#define TCP_WND     (4 * TCP_MSS)
+#define TCP_SND_BUF (2 * TCP_MSS)
+#define TCP_WND_UPDATE_THRESHOLD (TCP_WND/4 < 4*TCP_MSS ? TCP_WND/4 : 4*TCP_MSS)
+
+#define ASYNC_WRITE_FLAG_COPY 0x01
+#define ASYNC_WRITE_FLAG_MORE 0x02
+
+class AsyncClient;
+
+typedef std::function<void(void*, AsyncClient*)> AcConnectHandler;
+typedef std::function<void(void*, AsyncClient*, size_t len, uint32_t time)> AcAckHandler;
+typedef std::function<void(void*, AsyncClient*, int8_t error)> AcErrorHandler;
+typedef std::function<void(void*, AsyncClient*, void *data, size_t len)> AcDataHandler;
+typedef std::function<void(void*, AsyncClient*, uint32_t time)> AcTimeoutHandler;
+
+class AsyncClient {
+  public:
+    AsyncClient(sim::Peer *peer);
+    ~AsyncClient();
+
+    bool connected() { return _connected; }
+    bool freeable() { return !_connected; }
+    void close(bool now = false);
+    void abort() { close(true); }
+
+    bool canSend() { return space() > 0; }
+    size_t space();
+    size_t add(const char *data, size_t size, uint8_t apiflags = 0);
+    bool send();
+    size_t write(const char *data, size_t size, uint8_t apiflags = 0) {
+        size_t n = add(data, size, apiflags);
+        if (n && !send()) return 0;
+        return n;
+    }
+    size_t ack(size_t len);
+    void ackLater() { _ackLater = true; }
+
+    void setRxTimeout(uint32_t timeout) { _rxTimeout = timeout; }
+    uint32_t getRxTimeout() { return _rxTimeout; }
+    void setAckTimeout(uint32_t timeout) { _ackTimeout = timeout; }
+    uint32_t getAckTimeout() { return _ackTimeout; }
+    void setNoDelay(bool nodelay) { _noDelay = nodelay; }
+    bool getNoDelay() { return _noDelay; }
+    uint16_t getMss() { return TCP_MSS; }
+
+    IPAddress remoteIP();
+    uint16_t remotePort();
+    const char *errorToString(int8_t error) { return "ERR"; }
+
+    void onData(AcDataHandler cb, void *arg = 0) { _dataCb = cb; _dataArg = arg; }
+    void onAck(AcAckHandler cb, void *arg = 0) { _ackCb = cb; _ackArg = arg; }
+    void onError(AcErrorHandler cb, void *arg = 0) { _errorCb = cb; _errorArg = arg; }
+    void onDisconnect(AcConnectHandler cb, void *arg = 0) { _discCb = cb; _discArg = arg; }
+    void onTimeout(AcTimeoutHandler cb, void *arg = 0) { _timeoutCb = cb; _timeoutArg = arg; }
+    void onPoll(AcConnectHandler cb, void *arg = 0) { _pollCb = cb; _pollArg = arg; }
+
+    // simulation
+
+    struct Seg {                  // a chunk of data handed to add()
+        const char *ref;          // referenced data for zero-copy adds (apiflags==0)
+        std::string data;         // copy of the data at the time of add()
+    };
+
+    void output();                // lwip tcp_output
+    void recvSeg(const std::string &data);
+    void recvAck(uint32_t ackno, uint32_t wnd);
+    void sendAck();               // send ack for data received from peer
+    void fastTimer();             // lwip tcp_fasttmr: delayed acks
+    void slowTimer();             // lwip tcp_slowtmr: poll and timeouts
+
+    sim::Peer *_peer;
+    bool _connected;
+    bool _noDelay;
+    bool _ackLater;
+    uint32_t _rxTimeout, _ackTimeout;
+    uint32_t _lastRx, _lastAck;
+    // bridge-to-peer direction
+    std::deque<Seg> _segs;        // data added but not yet acked
+    size_t _unsentLen;            // bytes added but not yet transmitted
+    size_t _unackedLen;           // bytes transmitted but not yet acked
+    size_t _txIdx, _txOff;        // position of the next byte to transmit in _segs
+    size_t _ackOff;               // bytes of _segs.front() that have been acked
+    uint32_t _sndNxt, _sndUna;    // sequence numbers
+    uint32_t _peerWnd;            // window advertised by the peer
+    uint32_t _peerAck;            // ack number the peer window applies to
+    // peer-to-bridge direction
+    uint32_t _rcvNxt;             // bytes received
+    uint32_t _rcvRecved;          // bytes passed to tcp_recved(), i.e. acked by the app
+    uint32_t _rcvAdvertised;      // right edge of the window last advertised
+    int _unackedSegs;             // segments received but not acked yet
+
+    AcDataHandler _dataCb;       void *_dataArg;
+    AcAckHandler _ackCb;         void *_ackArg;
+    AcErrorHandler _errorCb;     void *_errorArg;
+    AcConnectHandler _discCb;    void *_discArg;
+    AcTimeoutHandler _timeoutCb; void *_timeoutArg;
+    AcConnectHandler _pollCb;    void *_pollArg;
+};
+
+class AsyncServer {
+  public:
+    AsyncServer(uint16_t port) : _port(port), _noDelay(false), _cb(0), _cbArg(0) {}
+    void onClient(AcConnectHandler cb, void *arg) { _cb = cb; _cbArg = arg; }
+    void begin();
+    void end();
+    void setNoDelay(bool nodelay) { _noDelay = nodelay; }
+    bool getNoDelay() { return _noDelay; }
+
+    uint16_t _port;
+    bool _noDelay;
+    AcConnectHandler _cb;
+    void *_cbArg;
+};
+
+#endif // ESPAsyncTCP_h
@@ -0,0 +1,43 @@
+// Esp-link-v4 host build
+// Copyright (C) 2018 by Throsten von Eicken
+
+// ESPAsyncUDP.h is a stand-in for the ESPAsyncUDP library. Datagrams travel to and from simulated
+// peers across the same network as the TCP connections and are lost at the rate sim::udpLoss.
+
+#ifndef ESPAsyncUDP_h
+#define ESPAsyncUDP_h
+
+#include <string>
+#include "Arduino.h"
+
+class AsyncUDPPacket {
+  public:
+    AsyncUDPPacket(const std::string &data, IPAddress ip, uint16_t port) :
+        _data(data), _ip(ip), _port(port) {}
+    uint8_t *data() { return (uint8_t*)&_data[0]; }
+    size_t length() { return _data.size(); }
+    IPAddress remoteIP() { return _ip; }
+    uint16_t remotePort() { return _port; }
+
+    std::string _data;
+    IPAddress _ip;
+    uint16_t _port;
+};
+
+typedef std::function<void(void*, AsyncUDPPacket&)> AuPacketHandlerFunctionWithArg;
+
+class AsyncUDP {
+  public:
+    AsyncUDP() : _port(0), _cbArg(0) {}
+    ~AsyncUDP() { close(); }
+    bool listen(uint16_t port);
+    void close();
+    void onPacket(AuPacketHandlerFunctionWithArg cb, void *arg = 0) { _cb = cb; _cbArg = arg; }
+    size_t writeTo(const uint8_t *data, size_t len, const IPAddress addr, uint16_t port);
+
+    uint16_t _port;
+    AuPacketHandlerFunctionWithArg _cb;
+    void *_cbArg;
+};
+
+#endif // ESPAsyncUDP_h
@@ -0,0 +1,86 @@
+// Esp-link-v4 host build
+// Copyright (C) 2018 by Throsten von Eicken
+
+// ESPAsyncWebServer.h is a stand-in for the WebSocket part of the ESPAsyncWebServer library. A
+// WebSocket client runs over a simulated AsyncClient, skipping the HTTP upgrade. Like the real
+// thing it queues up to WS_MAX_QUEUED_MESSAGES messages, copies each one, and removes it from the
+// queue once it has been acked. The simulated peers send the payload unframed and each segment is
+// delivered as a final binary frame.
+
+#ifndef ESPAsyncWebServer_h
+#define ESPAsyncWebServer_h
+
+#include <deque>
+#include <string>
+#include "ESPAsyncTCP.h"
+
+#define WS_MAX_QUEUED_MESSAGES 8
+
+typedef enum {
+    WS_EVT_CONNECT, WS_EVT_DISCONNECT, WS_EVT_PONG, WS_EVT_ERROR, WS_EVT_DATA
+} AwsEventType;
+typedef enum {
+    WS_CONTINUATION, WS_TEXT, WS_BINARY, WS_DISCONNECT = 0x08, WS_PING, WS_PONG
+} AwsFrameType;
+
+typedef struct {
+    uint8_t message_opcode;
+    uint32_t num;
+    uint8_t final;
+    uint8_t masked;
+    uint8_t opcode;
+    uint64_t len;
+    uint8_t mask[4];
+    uint64_t index;
+} AwsFrameInfo;
+
+class AsyncWebSocket;
+
+class AsyncWebSocketClient {
+  public:
+    AsyncWebSocketClient(AsyncClient *client, AsyncWebSocket *server);
+    ~AsyncWebSocketClient();
+
+    AsyncClient *client() { return _client; }
+    IPAddress remoteIP() { return _client ? _client->remoteIP() : IPAddress(); }
+    uint16_t remotePort() { return _client ? _client->remotePort() : 0; }
+    bool queueIsFull() { return _queue.size() >= WS_MAX_QUEUED_MESSAGES || !_client; }
+    void binary(const uint8_t *message, size_t len);
+    void close(uint16_t code=0, const char *message=0);
+
+    void *_tempObject;
+
+    // simulation
+
+    struct Msg {
+        std::string data;         // frame header and payload
+        size_t sent, acked;
+    };
+    void _runQueue();
+    void _onAck(size_t len);
+    void _onData(void *data, size_t len);
+    void _onDisconnect();
+
+    AsyncClient *_client;
+    AsyncWebSocket *_server;
+    std::deque<Msg> _queue;
+};
+
+typedef std::function<void(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type,
+        void *arg, uint8_t *data, size_t len)> AwsEventHandler;
+
+class AsyncWebSocket {
+  public:
+    AsyncWebSocket(const char *url) : _url(url) {}
+    void onEvent(AwsEventHandler handler) { _handler = handler; }
+
+    void _handleEvent(AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data,
+            size_t len) {
+        if (_handler) _handler(this, client, type, arg, data, len);
+    }
+
+    const char *_url;
+    AwsEventHandler _handler;
+};
+
+#endif // ESPAsyncWebServer_h
@@ -0,0 +1,89 @@
+// Esp-link-v4 host build
+// Copyright (C) 2018 by Throsten von Eicken
+
+// HardwareSerial is a stand-in for the esp8266 uart driver. It models a uart that transmits and
+// receives at the configured baud rate: received bytes are taken from a simulated device and
+// land in the driver's rx buffer (or are lost if it's full), written bytes go into the 128-byte
+// tx fifo from where they trickle out to the device.
+
+#ifndef HardwareSerial_h
+#define HardwareSerial_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <deque>
+#include <vector>
+
+#define UART_TX_FIFO_SIZE 128
+
+// uart config fields as defined by the esp8266 core's uart.h
+#define UART_NB_BIT_MASK      0B00001100
+#define UART_NB_BIT_5         0B00000000
+#define UART_NB_BIT_6         0B00000100
+#define UART_NB_BIT_7         0B00001000
+#define UART_NB_BIT_8         0B00001100
+#define UART_PARITY_MASK      0B00000011
+#define UART_PARITY_NONE      0B00000000
+#define UART_PARITY_EVEN      0B00000010
+#define UART_PARITY_ODD       0B00000011
+#define UART_NB_STOP_BIT_MASK 0B00110000
+#define UART_NB_STOP_BIT_1    0B00010000
+#define UART_NB_STOP_BIT_15   0B00100000
+#define UART_NB_STOP_BIT_2    0B00110000
+
+enum SerialConfig {
+    SERIAL_8N1 = UART_NB_BIT_8 | UART_PARITY_NONE | UART_NB_STOP_BIT_1,
+};
+
+struct HardwareSerial {
+    HardwareSerial(int uart_nr);
+
+    void begin(unsigned long baud) { begin(baud, SERIAL_8N1); }
+    void begin(unsigned long baud, SerialConfig config);
+    void end() {}
+    void updateBaudRate(unsigned long baud);
+    unsigned long baudRate() { return _baud; }
+    size_t setRxBufferSize(size_t size);
+
+    int available();
+    int availableForWrite();
+    int peek();
+    int read();
+    size_t read(char *buffer, size_t size);
+    size_t readBytes(char *buffer, size_t size) { return read(buffer, size); }
+    size_t write(uint8_t c) { return write(&c, 1); }
+    size_t write(const uint8_t *buffer, size_t size);
+    size_t write(const char *buffer, size_t size) { return write((const uint8_t *)buffer, size); }
+    void flush();
+    bool hasOverrun();
+    operator bool() const { return true; }
+
+    // simulation
+
+    // advance moves the uart forward to time t, i.e. moves bytes on the wire in both directions
+    void advance(uint64_t t);
+    uint64_t byteTime() { return 100000000ULL / _baud; } // 10 bits, in 1/10 microseconds
+
+    int _nr;
+    unsigned long _baud;
+    SerialConfig _config;
+    std::vector<uint8_t> _rxBuf;   // driver rx buffer
+    size_t _rxRd, _rxLen;
+    bool _overrun;                 // overrun flag as reported by hasOverrun()
+    std::deque<uint8_t> _txFifo;   // hardware tx fifo
+    uint64_t _rxNext;              // time when next rx byte completes, in 1/10 us
+    uint64_t _txNext;              // time when next tx byte completes, in 1/10 us
+    uint64_t _now;                 // time up to which the uart has been advanced, in 1/10 us
+};
+
+extern HardwareSerial Serial;
+
+// USD(u) is the clock divider register of uart u, AVRFlash writes it to change the baud rate
+#define ESP8266_CLOCK 80000000UL
+struct UartClkDiv {
+    int nr;
+    void operator=(uint32_t div);
+};
+#define USD(u) (UartClkDiv{u})
+
+#endif // HardwareSerial_h
@@ -0,0 +1,48 @@
+// Esp-link-v4 host build
+// Copyright (C) 2018 by Throsten von Eicken
+
+// Ticker runs callbacks on the simulated clock, mirroring the esp8266 core's Ticker API.
+
+#ifndef Ticker_h
+#define Ticker_h
+
+#include <memory>
+#include "sim.h"
+
+class Ticker {
+public:
+    Ticker() : _gen(std::make_shared<uint32_t>(0)) {}
+    ~Ticker() { detach(); }
+
+    template<typename TArg>
+    void attach_ms(uint32_t ms, void (*cb)(TArg), TArg arg) { arm(ms, true, [=]() { cb(arg); }); }
+    template<typename TArg>
+    void once_ms(uint32_t ms, void (*cb)(TArg), TArg arg) { arm(ms, false, [=]() { cb(arg); }); }
+    void attach_ms(uint32_t ms, void (*cb)()) { arm(ms, true, cb); }
+    void once_ms(uint32_t ms, void (*cb)()) { arm(ms, false, cb); }
+
+    // detach cancels the pending callback, events already queued see a stale generation
+    void detach() { ++*_gen; }
+    bool active() { return _armed; }
+
+private:
+    void arm(uint32_t ms, bool repeat, std::function<void()> fn) {
+        detach();
+        _armed = true;
+        schedule(ms*1000ULL, repeat, fn, _gen, *_gen);
+    }
+    void schedule(uint64_t us, bool repeat, std::function<void()> fn,
+            std::shared_ptr<uint32_t> gen, uint32_t g) {
+        sim::at(sim::now + us, [=]() {
+            if (*gen != g) return;
+            if (repeat) schedule(us, repeat, fn, gen, g);
+            else _armed = false;
+            fn();
+        });
+    }
+
+    std::shared_ptr<uint32_t> _gen;
+    bool _armed = false;
+};
+
+#endif // Ticker_h
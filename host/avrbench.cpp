@@ -0,0 +1,130 @@
+// Esp-link-v4 host build
+// Copyright (C) 2018 by Throsten von Eicken
+
+// avrbench flashes an image into the simulated optiboot at the other end of the uart using
+// AVRFlash and reports how long the programming takes compared to its lower bound: the time the
+// commands and pages take on the wire plus the time optiboot spends writing the pages. The image
+// is fed to AVRFlash in chunks, the way the HTTP server delivers the POSTed image, holding off
+// while AVRFlash's page pool is full.
+//
+// Usage: avrbench [-b baud,...] [-k kbytes] [-c chunk] [-w page_write_us] [-Y file]
+//   -b sets the baud rates, the default is 57600,115200,230400
+//   -k sets the size of the sketch in KB, the default is 32KB minus the 512-byte bootloader
+//   -c sets the chunk size, the default is 1460
+//   -w sets the time optiboot takes to write a page, the default is 4500us
+//   -Y records a trace and writes the dump of the last run to file, see tracedump
+//
+// The columns are: the baud rate, the number of pages, the time from sync to done and the time
+// spent programming the pages in seconds, the lower bound for the latter, the efficiency, i.e.,
+// the ratio of the two, the chars optiboot lost, and whether the flash holds the image.
+
+#include <unistd.h>
+#include "sim.h"
+#include "AVRFlash.h"
+#include "hexgen.h"
+#include "TraceRing.h"
+
+#define RESET_PIN 4
+
+// TraceFile writes a trace dump to a file.
+struct TraceFile {
+    FILE *f;
+    size_t write(const uint8_t *buf, size_t len) { return fwrite(buf, 1, len, f); }
+};
+
+struct Run {
+    bool stopped;   // AVRFlash stopped the input
+    bool done;      // AVRFlash called the done callback
+    uint64_t doneAt;
+};
+
+static void stopCB(Run *r) { r->stopped = true; }
+static void resumeCB(Run *r) { r->stopped = false; }
+static void doneCB(Run *r) {
+    r->done = true;
+    r->doneAt = sim::now;
+}
+
+static void runOne(uint32_t baud, uint32_t bytes, uint32_t chunk, uint32_t pageWriteUs,
+        bool trace) {
+    sim::reset();
+    if (trace) traceRing.begin(8192);
+    sim::Optiboot ob;
+    ob.pageWriteUs = pageWriteUs;
+    sim::optiboot = &ob;
+    Serial.begin(baud);
+
+    HexWriter w;
+    w.section(0, bytes, 16);
+    w.eof();
+    std::string hex = w.hex;
+
+    Run r = {};
+    AVRFlash *flash = new AVRFlash(Serial, RESET_PIN, baud);
+    flash->sync();
+    size_t off = 0;
+    bool finished = false;
+    while (!r.done && sim::now < 60000000) {
+        // each chunk is consumed whole, the next one waits while the input is stopped
+        if (!r.stopped && off < hex.size() && !flash->hasError()) {
+            size_t n = std::min<size_t>(chunk, hex.size()-off);
+            off += flash->write((uint8_t*)&hex[off], n, stopCB, resumeCB, &r);
+        }
+        if (!finished && (off == hex.size() || flash->hasError())) {
+            finished = true;
+            flash->finish(doneCB, &r);
+        }
+        sim::run(sim::now + 100);
+    }
+
+    // lower bound: LOAD_ADDRESS, PROG_PAGE and the acks on the wire, and writing the pages
+    uint32_t pages = (bytes+flash->_pageSz-1)/flash->_pageSz;
+    double wire = (pages*(4+4+1) + bytes) * 10.0 / baud + pages*pageWriteUs/1e6;
+    double total = r.doneAt/1e6;
+    double prog = (r.doneAt - flash->_startTime*1000ULL)/1e6;
+    bool ok = !flash->hasError() && r.done &&
+            std::equal(w.image.begin(), w.image.end(), ob.flash.begin());
+    printf("%7u %6u %7.2f %7.2f %7.2f %5.0f%% %6u  %s\n", baud, ob.pages, total, prog, wire,
+            100*wire/prog, ob.lost, ok ? "ok" : flash->hasError() ? flash->getError() : "bad");
+    delete flash;
+}
+
+static std::vector<uint32_t> parseList(const char *s) {
+    std::vector<uint32_t> v;
+    while (*s) {
+        v.push_back(strtoul(s, (char**)&s, 10));
+        if (*s == ',') s++;
+    }
+    return v;
+}
+
+int main(int argc, char **argv) {
+    std::vector<uint32_t> bauds = { 57600, 115200, 230400 };
+    uint32_t bytes = 32*1024-512, chunk = 1460, pageWriteUs = 4500;
+    const char *traceFile = 0;
+    int c;
+    while ((c = getopt(argc, argv, "b:k:c:w:Y:")) != -1) {
+        switch (c) {
+        case 'b': bauds = parseList(optarg); break;
+        case 'k': bytes = atoi(optarg)*1024; break;
+        case 'c': chunk = atoi(optarg); break;
+        case 'w': pageWriteUs = atoi(optarg); break;
+        case 'Y': traceFile = optarg; break;
+        default:
+            fprintf(stderr, "usage: see the comment at the top of avrbench.cpp\n");
+            return 1;
+        }
+    }
+
+    printf("%u bytes in chunks of %u, page write %uus\n", bytes, chunk, pageWriteUs);
+    printf("   baud  pages total s  prog s  limit s   eff   lost\n");
+    for (uint32_t baud : bauds) runOne(baud, bytes, chunk, pageWriteUs, traceFile != 0);
+    if (traceFile) {
+        TraceFile tf = { fopen(traceFile, "wb") };
+        if (tf.f) {
+            traceRing.dump(tf);
+            fclose(tf.f);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,261 @@
+// Esp-link-v4 host build
+// Copyright (C) 2018 by Throsten von Eicken
+
+// hexbench feeds Intel HEX images to HexRecord, the parser that turns the POSTed image into the
+// pages AVRFlash programs, and reports how fast it parses and pages them and how much memory it
+// uses doing so. The images are delivered in chunks of the given sizes to mimic the way they
+// arrive over TCP and through the HTTP server, and the pages are dequeued and freed after each
+// chunk the way the programmer does.
+//
+// Usage: hexbench [-c chunk,...] [-p page_size] [-t secs] [-v] [file.hex...]
+//   -c sets the chunk sizes, 0 stands for random sizes of 1 to 1460 bytes, the default is
+//      64,536,1460,0
+//   -p sets the flash page size used for the files given, the default is 128 (328P), use 256 for
+//      the 2560
+//   -t sets the time each image is parsed repeatedly for at each chunk size
+//   -v prints the pages of each image
+//
+// Without files it runs a built-in corpus that looks like the output of avr-objcopy:
+//   328p   28KB sketch at 0 in 16-byte records, 128-byte pages
+//   gaps   328p image with sections that start and end in the middle of pages, two of them in the
+//          same page, and with the optiboot bootloader merged in at 0x7e00
+//   order  328p image with the bootloader first and a section at 0x100 before the one at 0
+//   2560   160KB sketch plus a 4KB section at 0x3e000, 0x02 records at each 64KB, 256-byte pages
+//   large  252KB in 32-byte records, 0x04 records at each 64KB, 256-byte pages
+//
+// The columns are: the image, its size in hex, the chunk size, the parsing rate in MB of hex per
+// second, the number of pages produced, the number of times HexRecord stopped the input because its
+// page pool was full and it held on to the rest of a chunk, the number of heap allocations per
+// image, the peak heap usage while parsing an image, including HexRecord itself, and a hash of the
+// data, which only depends on the address and value of the bytes that aren't 0xff and not on how
+// they're paged.
+
+#include <malloc.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <Arduino.h>
+#include "HexRecord.h"
+#include "hexgen.h"
+
+//===== Counting allocator
+
+// The C library's allocator is interposed to count the allocations and track the live and peak
+// heap usage while an image is being parsed.
+
+extern "C" void *__libc_malloc(size_t);
+extern "C" void *__libc_calloc(size_t, size_t);
+extern "C" void *__libc_realloc(void *, size_t);
+extern "C" void __libc_free(void *);
+
+static bool counting;
+static uint32_t allocs;
+static size_t live, peak;
+
+static void *counted(void *p) {
+    if (p && counting) {
+        allocs++;
+        live += malloc_usable_size(p);
+        if (live > peak) peak = live;
+    }
+    return p;
+}
+
+static void uncount(void *p) {
+    if (p && counting) live -= std::min(live, malloc_usable_size(p));
+}
+
+extern "C" void *malloc(size_t sz) { return counted(__libc_malloc(sz)); }
+extern "C" void *calloc(size_t n, size_t sz) { return counted(__libc_calloc(n, sz)); }
+extern "C" void *realloc(void *p, size_t sz) {
+    uncount(p);
+    if (p && counting) allocs--; // a resize isn't a new allocation
+    return counted(__libc_realloc(p, sz));
+}
+extern "C" void free(void *p) { uncount(p); __libc_free(p); }
+
+//===== Corpus
+
+struct Image {
+    std::string name;
+    std::string hex;
+    uint16_t pageSz;
+};
+
+static std::vector<Image> builtinCorpus() {
+    std::vector<Image> corpus;
+    HexWriter w328;
+    w328.section(0, 28*1024, 16);
+    w328.eof();
+    corpus.push_back({ "328p", w328.hex, 128 });
+    HexWriter wg;
+    wg.section(0, 0x1000-21, 16);
+    wg.section(0x1000-13, 0x333, 16);
+    wg.section(0x5005, 1000, 16);
+    wg.section(0x7e00, 512, 16);
+    wg.eof();
+    corpus.push_back({ "gaps", wg.hex, 128 });
+    HexWriter wo;
+    wo.section(0x7e00, 512, 16);
+    wo.section(0x100, 0x1000, 16);
+    wo.section(0, 0x100-5, 16);
+    wo.eof();
+    corpus.push_back({ "order", wo.hex, 128 });
+    HexWriter w2560;
+    w2560.segments = true;
+    w2560.section(0, 160*1024, 16);
+    w2560.section(0x3e000, 4*1024, 16);
+    w2560.eof();
+    corpus.push_back({ "2560", w2560.hex, 256 });
+    HexWriter wl;
+    wl.section(0, 252*1024, 32);
+    wl.eof();
+    corpus.push_back({ "large", wl.hex, 256 });
+    return corpus;
+}
+
+static bool readImage(const char *path, uint16_t pageSz, Image &img) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return false;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) img.hex.append(buf, n);
+    fclose(f);
+    const char *s = strrchr(path, '/');
+    img.name = s ? s+1 : path;
+    img.pageSz = pageSz;
+    return true;
+}
+
+//===== Benchmark
+
+struct Result {
+    uint32_t pages;
+    uint32_t stops;
+    uint32_t allocs;
+    size_t peak;
+    uint32_t hash;
+    const char *err;
+};
+
+static void stopCB(Result *r) { r->stops++; }
+static void resumeCB(Result *r) {}
+
+// drain dequeues and frees the pages the way AVRFlash does, adding them to the result
+static void drain(HexRecord *hr, Result &r, bool verbose) {
+    FlashPage *fp;
+    while ((fp = hr->nextPage()) != 0) {
+        r.pages++;
+        for (int i=0; i<fp->len; i++) {
+            if (fp->data[i] != 0xff) r.hash += ((fp->addr+i)*2654435761u) ^ fp->data[i];
+        }
+        if (verbose) printf("    page 0x%05x %3d bytes\n", fp->addr, fp->len);
+        hr->freePage();
+    }
+}
+
+// parseImage parses the image once, delivering it in chunks of chunkSz bytes (random if 0),
+// each chunk is consumed whole, HexRecord holds on to what its page pool has no room for yet
+static Result parseImage(const Image &img, uint32_t chunkSz, bool verbose) {
+    Result r = {};
+    std::string hex = img.hex; // the parser is passed a writable buffer
+    uint8_t *data = (uint8_t *)&hex[0];
+    size_t len = hex.size();
+    uint32_t rnd = 1;
+
+    allocs = 0;
+    live = peak = 0;
+    counting = true;
+    HexRecord *hr = new HexRecord(img.pageSz);
+    for (size_t off=0; off < len && !hr->hasError(); ) {
+        size_t n = chunkSz;
+        if (n == 0) {
+            rnd = rnd*1103515245 + 12345;
+            n = 1 + (rnd>>16) % 1460;
+        }
+        if (n > len-off) n = len-off;
+        off += hr->write(data+off, n, stopCB, resumeCB, &r); // n, 0 on error
+        drain(hr, r, verbose);
+    }
+    if (!hr->_eof && !hr->hasError()) strcpy(hr->_errMessage, "no EOF record");
+    r.err = hr->hasError() ? strdup(hr->getError()) : 0;
+    delete hr;
+    counting = false;
+    r.allocs = allocs;
+    r.peak = peak;
+    return r;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static std::vector<uint32_t> parseList(const char *s) {
+    std::vector<uint32_t> v;
+    while (*s) {
+        v.push_back(strtoul(s, (char**)&s, 10));
+        if (*s == ',') s++;
+    }
+    return v;
+}
+
+int main(int argc, char **argv) {
+    std::vector<uint32_t> chunks = { 64, 536, 1460, 0 };
+    uint16_t pageSz = 128;
+    double secs = 0.5;
+    bool verbose = false;
+    int c;
+    while ((c = getopt(argc, argv, "c:p:t:v")) != -1) {
+        switch (c) {
+        case 'c': chunks = parseList(optarg); break;
+        case 'p': pageSz = atoi(optarg); break;
+        case 't': secs = atof(optarg); break;
+        case 'v': verbose = true; break;
+        default:
+            fprintf(stderr, "usage: see the comment at the top of hexbench.cpp\n");
+            return 1;
+        }
+    }
+
+    std::vector<Image> corpus;
+    if (optind == argc) {
+        corpus = builtinCorpus();
+    } else {
+        for (int i=optind; i<argc; i++) {
+            Image img;
+            if (!readImage(argv[i], pageSz, img)) {
+                fprintf(stderr, "cannot read %s\n", argv[i]);
+                return 1;
+            }
+            corpus.push_back(img);
+        }
+    }
+
+    printf("image      hex KB  chunk   MB/s  pages  stops allocs  peak B      hash\n");
+    for (const Image &img : corpus) {
+        for (uint32_t chunk : chunks) {
+            Result r = parseImage(img, chunk, verbose);
+            if (r.err) {
+                printf("%-10s error: %s\n", img.name.c_str(), r.err);
+                free((void*)r.err);
+                break;
+            }
+            int iter = 0;
+            double start = now(), elapsed;
+            do {
+                parseImage(img, chunk, false);
+                iter++;
+                elapsed = now() - start;
+            } while (elapsed < secs);
+            char chunkStr[16];
+            if (chunk) snprintf(chunkStr, sizeof(chunkStr), "%u", chunk);
+            else strcpy(chunkStr, "rand");
+            printf("%-10s %6zu %6s %6.1f %6u %6u %6u %7zu  %08x\n", img.name.c_str(),
+                    img.hex.size()/1024, chunkStr, img.hex.size()*iter/elapsed/1e6, r.pages,
+                    r.stops, r.allocs, r.peak, r.hash);
+        }
+    }
+    return 0;
+}
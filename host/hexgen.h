@@ -0,0 +1,62 @@
+// Esp-link-v4 host build
+// Copyright (C) 2018 by Throsten von Eicken
+
+// hexgen generates Intel HEX images for the benchmarks of HexRecord and AVRFlash.
+
+#ifndef hexgen_h
+#define hexgen_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// HexWriter produces the records avr-objcopy would for a number of sections.
+struct HexWriter {
+    std::string hex;
+    std::vector<uint8_t> image; // the binary image, 0xff where there's no data
+    bool segments = false; // use 0x02 extended segment records instead of 0x04 like avr-objcopy
+    uint32_t seg = 0; // upper 16 bits of the address set by the last 0x02 or 0x04 record
+    uint32_t rnd = 12345;
+
+    void record(uint8_t type, uint16_t addr, const uint8_t *data, int len) {
+        char buf[2*(5+255)+4];
+        uint8_t sum = len + (addr>>8) + addr + type;
+        int o = sprintf(buf, ":%02X%04X%02X", len, addr, type);
+        for (int i=0; i<len; i++) {
+            o += sprintf(buf+o, "%02X", data[i]);
+            sum += data[i];
+        }
+        sprintf(buf+o, "%02X\r\n", (uint8_t)-sum);
+        hex += buf;
+    }
+
+    // section appends len bytes of pseudo-random code at addr in records of recLen bytes
+    void section(uint32_t addr, uint32_t len, int recLen) {
+        while (len > 0) {
+            if ((addr>>16) != seg) {
+                seg = addr>>16;
+                uint16_t v = segments ? seg<<12 : seg;
+                uint8_t d[2] = { (uint8_t)(v>>8), (uint8_t)v };
+                record(segments ? 0x02 : 0x04, 0, d, 2);
+            }
+            int n = std::min<uint32_t>(std::min<uint32_t>(len, recLen), 0x10000-(addr&0xffff));
+            uint8_t d[255];
+            for (int i=0; i<n; i++) {
+                rnd = rnd*1103515245 + 12345;
+                d[i] = rnd>>16;
+            }
+            record(0x00, addr, d, n);
+            if (image.size() < addr+n) image.resize(addr+n, 0xff);
+            memcpy(&image[addr], d, n);
+            addr += n;
+            len -= n;
+        }
+    }
+
+    void eof() { record(0x01, 0, 0, 0); }
+};
+
+#endif // hexgen_h
@@ -0,0 +1,472 @@
+// Esp-link-v4 host build
+// Copyright (C) 2018 by Throsten von Eicken
+
+// sbrbench runs the SerialBridge against the simulated uart and TCP stack and reports throughput,
+// latency, uart overruns and stalls for a number of clients at different baud rates and MSS
+// values. The device on the uart transmits numbered lines continuously at the given load and the
+// first client optionally uploads data to the uart at the same time.
+//
+// Usage: sbrbench [-n clients] [-b baud,...] [-m mss,...] [-t secs] [-l load] [-u upload_bytes]
+//                 [-s stall_ms] [-p block|drop|disconnect] [-q ring_size] [-c bytes,delay_us]
+//                 [-f] [-w loop_us] [-e threshold,budget] [-T] [-a]
+//                 [-W any|exclusive|rr|msg[,quantum]] [-F slip|len] [-H size[,max_age_ms[,1]]]
+//                 [-j join_ms] [-M max_clients] [-R connects_per_sec] [-D dead_ms]
+//                 [-K idle_ms,ack_ms] [-U peers[,max_datagram,flush_us]] [-P loss_pct]
+//                 [-X ws_clients] [-A at_ms,for_ms[,baud]] [-Y file] [-k bytes[,horizon_ms]]
+//                 [-L latency_us] [-S] [-v]
+//   -s makes the last client stop reading for stall_ms out of every second
+//   -c sets the coalescing policy, with a newline flush char
+//   -f enables RTS/CTS flow control
+//   -w sets the time the sketch spends in each loop() iteration outside of the bridge
+//   -e puts the bridge into event-driven mode with the given rx threshold and budget
+//   -T puts the bridge into RFC 2217 mode, the first client purges the buffers, sets the
+//      line and modem state masks, and suspends and resumes the flow of data at 100ms and 200ms
+//   -a makes all clients upload at the same time, each sending lines of a different char
+//   -W sets the writer policy for clients that upload at the same time
+//   -F puts the bridge into framed mode, the device and the clients send SLIP or length-prefixed
+//      frames, and the number of frames the clients receive split across segments is printed
+//   -H keeps a history of the given size that is replayed to new clients, optionally with
+//      timestamps
+//   -j makes the last client connect join_ms into the run, the number of history lines it receives
+//      is printed
+//   -M sets the max number of clients, by default the number of clients or the bridge's default
+//   -R makes short-lived extra clients connect at the given rate and disconnect after 20ms, the
+//      number of connects, refused connects and leftover client handles is printed
+//   -D makes the last client vanish without closing the connection dead_ms into the run
+//   -K sets the bridge's idle and ack timeouts
+//   -U adds UDP subscribers, which upload a line every ms if all clients upload, and prints their
+//      latency and the datagrams lost and dropped
+//   -P sets the percentage of datagrams lost by the network
+//   -X makes the last ws_clients of the clients connect over WebSocket, their latency is also
+//      printed separately
+//   -A makes a flasher take the uart through the arbiter at at_ms for for_ms, running it at baud
+//      and reading what arrives, the data the clients uploaded that the device received and the
+//      baud rate after the uart is handed back are printed
+//   -k lets the bridge ack up to bytes ahead of the uart, those it expects to drain within
+//      horizon_ms
+//   -Y records a trace of each run and writes the dump of the last one to file, see tracedump
+//   -S prints the bridge's statistics after each run
+//
+// The columns are: uart-to-TCP throughput per client, TCP-to-uart throughput, p50/p99 latency of
+// the uart-to-TCP path, bytes lost to uart rx overruns and the number of overrun events, the
+// number of stalls, i.e., times the uart tx went idle for 1ms or more during the upload, and the
+// number of times RTS was deasserted, and the number of lines received by the device that mix
+// the data of different clients.
+
+#include <stdarg.h>
+#include <unistd.h>
+#include <algorithm>
+#include "sim.h"
+#include "SerialBridge.h"
+
+static bool verbose;
+
+static void dbg(const char *fmt, ...) {
+    if (!verbose) return;
+    va_list ap;
+    va_start(ap, fmt);
+    printf("%10.6f ", sim::now/1e6);
+    vprintf(fmt, ap);
+    va_end(ap);
+}
+
+static std::vector<uint32_t> parseList(const char *s) {
+    std::vector<uint32_t> v;
+    while (*s) {
+        v.push_back(strtoul(s, (char**)&s, 10));
+        if (*s == ',') s++;
+    }
+    return v;
+}
+
+struct Options {
+    int clients = 2;
+    double secs = 5;
+    double load = 1.0;
+    uint64_t upload = 0;
+    uint32_t stall = 0;
+    SbrLagPolicy policy = sbrBlock;
+    uint16_t ring = 4096;
+    uint16_t coalBytes = 0;
+    uint32_t coalDelay = 0;
+    bool flow = false;
+    uint32_t loopUs = 100;
+    uint16_t evThreshold = 0;
+    uint16_t evBudget = 0;
+    bool telnet = false;
+    bool allUpload = false;
+    SbrWriterPolicy writers = sbrWriteAny;
+    uint16_t quantum = 64;
+    SbrFraming framing = sbrRaw;
+    uint16_t histSize = 0;
+    uint32_t histAge = 0;
+    bool histStamps = false;
+    uint32_t join = 0;
+    int maxClients = 0;
+    uint32_t reconnects = 0;
+    uint32_t dead = 0;
+    uint32_t idleMs = 0, ackMs = 5000;
+    int udpPeers = 0;
+    uint16_t udpMax = 512;
+    uint32_t udpFlush = 2000;
+    int wsClients = 0;
+    uint32_t flashAt = 0, flashFor = 0, flashBaud = 57600;
+    const char *traceFile = 0;
+    uint16_t ackAhead = 0, ackHorizon = 20;
+    bool stats = false;
+};
+
+// TraceFile writes a trace dump to a file.
+struct TraceFile {
+    FILE *f;
+    size_t write(const uint8_t *buf, size_t len) { return fwrite(buf, 1, len, f); }
+};
+
+static void printStats(SerialBridge &sbr) {
+    SbrStats st;
+    sbr.stats(st);
+    printf("  overruns=%u refused=%u sendFailed=%u uartHigh=%u txRingHigh=%u loop:", st.overruns,
+            st.refused, st.sendFailed, st.uartHigh, st.txRingHigh);
+    for (int i=0; i<SBR_LOOP_HIST; i++) {
+        if (st.loopHist[i]) printf(" <%uus:%u", 1u<<i, st.loopHist[i]);
+    }
+    printf("\n");
+    SbrClientStats cst[8];
+    size_t n = sbr.clientStats(cst, 8);
+    for (size_t i=0; i<n; i++) {
+        printf("  client %d%s in=%u out=%u ackLater=%u ackedAhead=%u dropped=%u rxDropped=%u "
+                "rxBufHigh=%u\n", (int)i, cst[i].connected ? "" : " (closed)", cst[i].bytesIn,
+                cst[i].bytesOut, cst[i].ackLater, cst[i].ackedAhead, cst[i].dropped,
+                cst[i].rxDropped, cst[i].rxBufHigh);
+    }
+}
+
+static uint32_t percentile(std::vector<uint32_t> &v, int p) {
+    if (v.empty()) return 0;
+    return v[std::min(v.size()-1, v.size()*p/100)];
+}
+
+static void runOne(const Options &o, uint32_t baud, uint32_t mss) {
+    sim::reset();
+    sim::mss = mss;
+    if (o.traceFile) traceRing.begin(8192);
+    SerialBridge sbr;
+    sbr.debug(dbg);
+    sbr.backlog(o.ring, o.policy);
+    if (o.coalBytes) sbr.coalesce(o.coalBytes, o.coalDelay, '\n');
+    if (o.evBudget) sbr.eventDriven(o.evThreshold, o.evBudget);
+    if (o.ackAhead) sbr.ackAhead(o.ackAhead, o.ackHorizon);
+    if (o.telnet) sbr.rfc2217();
+    sbr.writers(o.writers, o.quantum);
+    sbr.framing(o.framing);
+    sim::framing = o.framing;
+    sbr.maxClients(o.maxClients ? o.maxClients : std::max(o.clients, SBR_MAX_CLIENTS));
+    sbr.timeouts(o.idleMs, o.ackMs);
+    if (o.udpPeers) sbr.udp(2323, o.udpMax, o.udpFlush);
+    if (o.histSize) sbr.history(o.histSize, o.histAge, o.histStamps);
+    UartArbiter arb;
+    sbr.arbiter(arb);
+    AsyncWebSocket ws("/serial");
+    if (o.wsClients) sbr.webSocket(ws);
+    int rts = -1, cts = -1;
+    if (o.flow) {
+        rts = 15;
+        cts = 13;
+        sim::device.rtsPin = rts;
+        sim::device.ctsPin = cts;
+        sim::device.sinkBuf = 256;
+        sim::device.sinkBps = baud/10;
+    }
+    sim::device.load = o.load;
+    sbr.begin(2323, baud, 2000, rts, cts);
+
+    std::vector<sim::Peer*> peers;
+    for (int i=0; i<o.clients; i++) {
+        if (i >= o.clients - o.wsClients) {
+            peers.push_back(sim::wsConnect(&ws));
+        } else if (i == o.clients-1 && o.join > 0) {
+            sim::at(o.join*1000, [&peers]() { peers.push_back(sim::connect(2323)); });
+        } else {
+            peers.push_back(sim::connect(2323));
+        }
+    }
+    if (o.stall > 0 && o.join == 0) {
+        peers.back()->stallEvery = 1000;
+        peers.back()->stallFor = o.stall;
+    }
+    for (int i=0; i<(o.allUpload ? o.clients : 1) && o.upload > 0; i++) {
+        peers[i]->txLeft = o.upload;
+        peers[i]->pump();
+    }
+
+    // RFC 2217 commands, which the bridge acks except for the flow control ones
+    auto comPort = [](sim::Peer *p, uint8_t cmd, int val) {
+        std::string sb = { (char)255, (char)250, 44, (char)cmd };
+        if (val >= 0) sb += (char)val;
+        p->sendRaw(sb + (char)255 + (char)240);
+    };
+    if (o.telnet && !peers.empty()) {
+        sim::at(100000, [&]() {
+            comPort(peers[0], 12, 3); // PURGE-DATA, both buffers
+            comPort(peers[0], 10, 0); // SET-LINESTATE-MASK
+            comPort(peers[0], 11, 0); // SET-MODEMSTATE-MASK
+            comPort(peers[0], 8, -1); // FLOWCONTROL-SUSPEND
+        });
+        sim::at(200000, [&]() { comPort(peers[0], 9, -1); }); // FLOWCONTROL-RESUME
+    }
+
+    // reconnect storm: short-lived clients that connect, idle for 20ms, and disconnect
+    uint32_t connects = 0;
+    std::function<void()> storm = [&]() {
+        sim::Peer *p = sim::connect(2323);
+        connects++;
+        if (p) sim::at(sim::now + 20000, [p]() { p->disconnect(); });
+        sim::at(sim::now + 1000000/o.reconnects, storm);
+    };
+    if (o.reconnects > 0) sim::at(100000, storm);
+    std::vector<sim::Peer*> udps;
+    for (int i=0; i<o.udpPeers; i++) udps.push_back(sim::subscribe(2323));
+    std::function<void()> udpTick = [&]() {
+        for (sim::Peer *p : udps) {
+            if (o.allUpload && p->txLeft > 0) {
+                std::string line(26, 0);
+                for (int j=0; j<26; j++) line[j] = p->uploadChar(j);
+                p->sendDatagram(2323, line);
+                p->txLeft -= std::min<uint64_t>(p->txLeft, line.size());
+            } else if (sim::now % 1000000 < 1000) {
+                p->sendDatagram(2323, ""); // keepalive
+            }
+        }
+        sim::at(sim::now + 1000, udpTick);
+    };
+    for (sim::Peer *p : udps) p->txLeft = o.upload;
+    if (!udps.empty()) sim::at(1000, udpTick);
+    // flasher: takes the uart, switches the baud rate and reads the responses every 5ms
+    static int flasher;
+    std::function<void()> flashTick = [&]() {
+        while (Serial.read() != -1) ;
+        if (sim::now < (o.flashAt + o.flashFor)*1000ULL) {
+            sim::at(sim::now + 5000, flashTick);
+        } else {
+            arb.release(&flasher);
+        }
+    };
+    if (o.flashFor > 0) {
+        sim::at(o.flashAt*1000, [&]() {
+            if (!arb.take(&flasher)) return;
+            Serial.updateBaudRate(o.flashBaud);
+            flashTick();
+        });
+    }
+    if (o.dead > 0) sim::at(o.dead*1000, [&peers]() { peers.back()->dead = true; });
+
+    // run the arduino loop, sampling the uart tx to detect stalls in the upload
+    uint64_t end = o.secs*1000000;
+    uint64_t idleSince = 0;
+    uint32_t stalls = 0, rtsToggles = 0;
+    int rtsLast = LOW;
+    while (sim::now < end) {
+        sim::run(sim::now);
+        sbr.loop();
+        if (rts >= 0 && sim::pins[rts] != rtsLast) {
+            rtsLast = sim::pins[rts];
+            if (rtsLast == HIGH) rtsToggles++;
+        }
+        uint64_t uploaded = 0;
+        for (sim::Peer *p : peers) uploaded += p->txBytes;
+        bool uploading = sim::device.rxBytes > 0 && sim::device.rxBytes < uploaded;
+        if (uploading && Serial._txFifo.empty()) {
+            if (idleSince == 0) idleSince = sim::now;
+        } else {
+            if (idleSince > 0 && sim::now - idleSince >= 1000) stalls++;
+            idleSince = 0;
+        }
+        sim::run(sim::now + o.loopUs);
+    }
+
+    // report
+    uint64_t bytes = 0;
+    std::vector<uint32_t> lat;
+    for (sim::Peer *p : peers) {
+        bytes += p->bytesRead;
+        lat.insert(lat.end(), p->latency.begin(), p->latency.end());
+    }
+    std::sort(lat.begin(), lat.end());
+    printf("%7u %5u %7.0f %7.0f %7.2f %7.2f %8llu %5u %6u %5u %5u\n", baud, mss,
+            o.clients ? bytes/o.secs/o.clients : 0, sim::device.rxBytes/o.secs,
+            percentile(lat, 50)/1000.0, percentile(lat, 99)/1000.0,
+            (unsigned long long)sim::device.lostBytes, sim::device.overruns, stalls, rtsToggles,
+            sim::device.rxMixed);
+    if (o.telnet && !peers.empty()) {
+        int acked = 0;
+        for (uint8_t r : peers[0]->comPortReplies) acked += r >= 110 && r <= 112;
+        bool suspended = false;
+        for (auto *cli : sbr._clients) suspended |= cli->suspended;
+        printf("  rfc2217: purge and state masks acked %d/3, %s\n", acked,
+                suspended ? "a client is still suspended" : "no client suspended");
+    }
+    if (o.framing) {
+        uint32_t split = 0;
+        for (sim::Peer *p : peers) split += p->splitFrames;
+        printf("  split frames: %u\n", split);
+    }
+    if (o.join > 0 && (int)peers.size() == o.clients) {
+        printf("  late client: replayed %u lines, received %u live lines, %u bad\n",
+                peers.back()->replayed, (unsigned)peers.back()->latency.size(),
+                peers.back()->badLines);
+    }
+    if (o.wsClients > 0) {
+        std::vector<uint32_t> wlat;
+        uint64_t wbytes = 0;
+        for (sim::Peer *p : peers) {
+            if (!p->ws) continue;
+            wlat.insert(wlat.end(), p->latency.begin(), p->latency.end());
+            wbytes += p->bytesRead;
+        }
+        std::sort(wlat.begin(), wlat.end());
+        printf("  websocket: %.0f B/s per client, p50 %.2f ms, p99 %.2f ms\n",
+                wbytes/o.secs/o.wsClients, percentile(wlat, 50)/1000.0,
+                percentile(wlat, 99)/1000.0);
+    }
+    if (!udps.empty()) {
+        std::vector<uint32_t> ulat;
+        uint32_t lost = 0, rxLost = 0, rxDropped = 0;
+        uint64_t ubytes = 0;
+        for (sim::Peer *p : udps) {
+            ulat.insert(ulat.end(), p->latency.begin(), p->latency.end());
+            lost += p->udpLost;
+            ubytes += p->bytesRead;
+        }
+        SbrUdpPeer st[SBR_UDP_PEERS];
+        size_t n = sbr.udpStats(st, SBR_UDP_PEERS);
+        for (size_t i=0; i<n; i++) {
+            rxLost += st[i].rxLost;
+            rxDropped += st[i].rxDropped;
+        }
+        std::sort(ulat.begin(), ulat.end());
+        printf("  udp: %.0f B/s per peer, p50 %.2f ms, p99 %.2f ms, lost to peers %u, "
+                "lost to bridge %u, dropped %u\n", ubytes/o.secs/udps.size(),
+                percentile(ulat, 50)/1000.0, percentile(ulat, 99)/1000.0, lost, rxLost, rxDropped);
+    }
+    if (o.flashFor > 0) {
+        uint64_t uploaded = 0;
+        int connected = 0;
+        for (sim::Peer *p : peers) {
+            uploaded += p->txBytes;
+            connected += !p->closed;
+        }
+        printf("  flash: uploaded %llu, received by device %llu, %lu baud after, "
+                "%d clients connected\n", (unsigned long long)uploaded,
+                (unsigned long long)sim::device.rxBytes, Serial.baudRate(), connected);
+    }
+    if (o.reconnects > 0) {
+        SbrStats st;
+        sbr.stats(st);
+        printf("  storm: %u connects, %u refused, %u client handles alive\n", connects, st.refused,
+                sim::liveClients);
+    }
+    if (o.traceFile) {
+        TraceFile tf = { fopen(o.traceFile, "wb") };
+        if (tf.f) {
+            traceRing.dump(tf);
+            fclose(tf.f);
+        }
+    }
+    if (sim::zeroCopyViolations) printf("  zero-copy violations: %u\n", sim::zeroCopyViolations);
+    if (o.stats) printStats(sbr);
+}
+
+int main(int argc, char **argv) {
+    Options o;
+    std::vector<uint32_t> bauds = { 115200, 460800, 921600 };
+    std::vector<uint32_t> msss = { 536, 1460 };
+    int c;
+    const char *opts = "n:b:m:t:l:u:s:p:q:c:fw:e:TaW:F:H:j:M:R:D:K:U:P:X:A:Y:k:L:Sv";
+    while ((c = getopt(argc, argv, opts)) != -1) {
+        switch (c) {
+        case 'n': o.clients = atoi(optarg); break;
+        case 'b': bauds = parseList(optarg); break;
+        case 'm': msss = parseList(optarg); break;
+        case 't': o.secs = atof(optarg); break;
+        case 'l': o.load = atof(optarg); break;
+        case 'u': o.upload = strtoull(optarg, 0, 10); break;
+        case 's': o.stall = atoi(optarg); break;
+        case 'p':
+            o.policy = !strcmp(optarg, "drop") ? sbrDropOldest :
+                       !strcmp(optarg, "disconnect") ? sbrDisconnect : sbrBlock;
+            break;
+        case 'q': o.ring = atoi(optarg); break;
+        case 'c': {
+            std::vector<uint32_t> v = parseList(optarg);
+            o.coalBytes = v.size() > 0 ? v[0] : 0;
+            o.coalDelay = v.size() > 1 ? v[1] : 0;
+            break; }
+        case 'f': o.flow = true; break;
+        case 'w': o.loopUs = atoi(optarg); break;
+        case 'e': {
+            std::vector<uint32_t> v = parseList(optarg);
+            o.evThreshold = v.size() > 0 ? v[0] : 64;
+            o.evBudget = v.size() > 1 ? v[1] : 512;
+            break; }
+        case 'T': o.telnet = true; break;
+        case 'a': o.allUpload = true; break;
+        case 'W': {
+            o.writers = !strncmp(optarg, "exclusive", 9) ? sbrWriteExclusive :
+                        !strncmp(optarg, "rr", 2) ? sbrWriteRoundRobin :
+                        !strncmp(optarg, "msg", 3) ? sbrWriteMessage : sbrWriteAny;
+            const char *q = strchr(optarg, ',');
+            if (q) o.quantum = atoi(q+1);
+            break; }
+        case 'F': o.framing = !strcmp(optarg, "len") ? sbrLenPrefix : sbrSlip; break;
+        case 'H': {
+            std::vector<uint32_t> v = parseList(optarg);
+            o.histSize = v[0];
+            o.histAge = v.size() > 1 ? v[1] : 0;
+            o.histStamps = v.size() > 2 && v[2];
+            break; }
+        case 'j': o.join = atoi(optarg); break;
+        case 'M': o.maxClients = atoi(optarg); break;
+        case 'R': o.reconnects = atoi(optarg); break;
+        case 'D': o.dead = atoi(optarg); break;
+        case 'K': {
+            std::vector<uint32_t> v = parseList(optarg);
+            o.idleMs = v.size() > 0 ? v[0] : 0;
+            o.ackMs = v.size() > 1 ? v[1] : 5000;
+            break; }
+        case 'U': {
+            std::vector<uint32_t> v = parseList(optarg);
+            o.udpPeers = v[0];
+            if (v.size() > 1) o.udpMax = v[1];
+            if (v.size() > 2) o.udpFlush = v[2];
+            break; }
+        case 'P': sim::udpLoss = atoi(optarg); break;
+        case 'X': o.wsClients = atoi(optarg); break;
+        case 'A': {
+            std::vector<uint32_t> v = parseList(optarg);
+            o.flashAt = v.size() > 0 ? v[0] : 0;
+            o.flashFor = v.size() > 1 ? v[1] : 0;
+            if (v.size() > 2) o.flashBaud = v[2];
+            break; }
+        case 'Y': o.traceFile = optarg; break;
+        case 'k': {
+            std::vector<uint32_t> v = parseList(optarg);
+            o.ackAhead = v.size() > 0 ? v[0] : 0;
+            if (v.size() > 1) o.ackHorizon = v[1];
+            break; }
+        case 'L': sim::latency = atoi(optarg); break;
+        case 'S': o.stats = true; break;
+        case 'v': verbose = true; break;
+        default:
+            fprintf(stderr, "usage: see the comment at the top of sbrbench.cpp\n");
+            return 1;
+        }
+    }
+
+    printf("%d clients, %.1fs, load %.2f, upload %llu\n", o.clients, o.secs, o.load,
+            (unsigned long long)o.upload);
+    printf("   baud   mss u2t B/s t2u B/s  p50 ms  p99 ms  overrun  runs stalls   rts mixed\n");
+    for (uint32_t baud : bauds) {
+        for (uint32_t mss : msss) runOne(o, baud, mss);
+    }
+    return 0;
+}
@@ -0,0 +1,825 @@
+// Esp-link-v4 host build
+// Copyright (C) 2018 by Throsten von Eicken
+
+#include <queue>
+#include <algorithm>
+#include "sim.h"
+#include "ESPAsyncUDP.h"
+#include "stk500.h"
+
+namespace sim {
+
+uint64_t now;
+uint32_t mss = 1460;
+uint32_t latency = 2000;
+uint32_t linkBps = 20000000;
+int framing;
+uint32_t zeroCopyViolations;
+uint32_t liveClients;
+uint8_t pins[17];
+Device device;
+Optiboot *optiboot;
+std::vector<Peer*> peers;
+static std::vector<AsyncServer*> servers;
+static std::vector<AsyncUDP*> udps;
+uint32_t udpLoss;
+static uint64_t linkFree; // time at which the (shared) network link becomes idle
+
+struct Event {
+    uint64_t t, seq;
+    std::function<void()> fn;
+    bool operator<(const Event &o) const { return t != o.t ? t > o.t : seq > o.seq; }
+};
+static std::priority_queue<Event> events;
+static uint64_t eventSeq;
+
+void at(uint64_t t, std::function<void()> fn) {
+    events.push(Event{t, eventSeq++, fn});
+}
+
+void run(uint64_t t) {
+    while (!events.empty() && events.top().t <= t) {
+        Event e = events.top();
+        events.pop();
+        if (e.t > now) now = e.t;
+        Serial.advance(now);
+        e.fn();
+    }
+    if (t > now) now = t;
+    Serial.advance(now);
+}
+
+void transmit(size_t len, std::function<void()> fn) {
+    uint64_t start = std::max(now, linkFree);
+    linkFree = start + (uint64_t)(len+40)*8*1000000/linkBps;
+    at(linkFree + latency, fn);
+}
+
+// lwip timers, the fast timer handles delayed acks and the slow timer polls
+static void fastTimer() {
+    for (Peer *p : peers) if (p->client && !p->closed) p->client->fastTimer();
+    at(now + 250000, fastTimer);
+}
+static void slowTimer() {
+    for (Peer *p : peers) if (p->client && !p->closed) p->client->slowTimer();
+    at(now + 500000, slowTimer);
+}
+
+void reset() {
+    while (!events.empty()) events.pop();
+    for (Peer *p : peers) {
+        if (p->client) p->client->_peer = 0;
+        delete p;
+    }
+    peers.clear();
+    servers.clear();
+    udps.clear();
+    now = 0;
+    linkFree = 0;
+    zeroCopyViolations = 0;
+    liveClients = 0; // clients of the previous run are abandoned along with its bridge
+    memset(pins, 0, sizeof(pins));
+    device = Device();
+    optiboot = 0;
+    device.load = 1.0;
+    device.rtsPin = -1;
+    device.ctsPin = -1;
+    Serial = HardwareSerial(0);
+    at(250000, fastTimer);
+    at(500000, slowTimer);
+}
+
+// ===== Device
+
+int Device::nextByte() {
+    if (lineBuf.empty()) {
+        char buf[16];
+        snprintf(buf, sizeof(buf), "%08u\n", line++);
+        lineBuf = buf;
+        if (framing == 1) lineBuf += (char)0xC0;
+        if (framing == 2) lineBuf = std::string("\0\x09", 2) + lineBuf;
+    }
+    uint8_t c = lineBuf[0];
+    lineBuf.erase(0, 1);
+    if (lineBuf.empty()) lineTime.push_back(now); // line is complete
+    txBytes++;
+    return c;
+}
+
+bool Device::clearToSend() {
+    return rtsPin < 0 || pins[rtsPin] == LOW;
+}
+
+void Device::recvByte(uint8_t c) {
+    rxBytes++;
+    if ((c < ' ' && c != '\n') || c == 0xC0) return; // framing
+    if (c != '\n') {
+        rxLine += c;
+    } else {
+        rxLines++;
+        if (rxLine.size() != 25 || rxLine.find_first_not_of(rxLine[0]) != std::string::npos)
+            rxMixed++;
+        rxLine.clear();
+    }
+    if (sinkBuf == 0) return;
+    updateCts();
+    if (sinkLevel >= sinkBuf) rxLost++;
+    else sinkLevel++;
+    updateCts();
+}
+
+// updateCts drains the device's buffer and drives CTS using 1/2 and 1/4 watermarks
+void Device::updateCts() {
+    if (sinkBuf == 0) return;
+    uint64_t drained = (now - sinkAt) * sinkBps / 1000000;
+    if (drained > 0) {
+        sinkLevel = drained > sinkLevel ? 0 : sinkLevel - drained;
+        sinkAt = now;
+    }
+    if (ctsPin < 0) return;
+    if (sinkLevel >= sinkBuf/2) pins[ctsPin] = HIGH;
+    else if (sinkLevel <= sinkBuf/4) pins[ctsPin] = LOW;
+}
+
+// ===== Peer
+
+Peer::Peer() : client(0), closed(false), dead(false), rcvNxt(0), bufSz(0), readBps(0),
+    stallEvery(0), stallFor(0), bytesRead(0), badLines(0), splitFrames(0), frameOff(0),
+    inStamp(false), joinLine(0), replayed(0), tnMatch(0), txLeft(0), sndNxt(0),
+    sndUna(0), sndRight(0), txBytes(0), id(0), udp(false), udpSeq(0), udpNext(0), udpLost(0),
+    ws(false), wsLeft(0) {}
+
+void Peer::recvSeg(const std::string &data) {
+    if (closed || dead) return;
+    rcvNxt += data.size();
+    if (!ws) {
+        unread += data;
+    } else {
+        // strip the headers of the frames: 0x82 and a 7-bit length, or 126 and a 16-bit length
+        for (size_t i = 0; i < data.size(); ) {
+            if (wsLeft > 0) {
+                size_t n = std::min<size_t>(wsLeft, data.size()-i);
+                unread += data.substr(i, n);
+                wsLeft -= n;
+                i += n;
+                continue;
+            }
+            wsHdr += data[i++];
+            if (wsHdr.size() < 2) continue;
+            uint8_t l = wsHdr[1];
+            if (l == 126 && wsHdr.size() < 4) continue;
+            wsLeft = l < 126 ? l : (uint8_t)wsHdr[2] << 8 | (uint8_t)wsHdr[3];
+            wsHdr.clear();
+        }
+    }
+    // count segments that don't end at a frame boundary, length-prefixed frames are 11 chars
+    frameOff = (frameOff + data.size()) % 11;
+    if (framing == 1 && !data.empty() && (uint8_t)data.back() != 0xC0) splitFrames++;
+    if (framing == 2 && frameOff != 0) splitFrames++;
+    if (readBps == 0 && stallEvery == 0) consume(unread.size());
+    sendAck();
+}
+
+void Peer::sendAck() {
+    uint32_t ackno = rcvNxt, right = rcvNxt + bufSz - unread.size();
+    transmit(0, [this, ackno, right]() { if (client && !closed) client->recvAck(ackno, right); });
+}
+
+// consume has the application read n bytes, parsing the numbered lines
+void Peer::consume(size_t n) {
+    for (size_t i=0; i<n; i++) {
+        char c = unread[i];
+        // RFC 2217 responses start with IAC SB COM-PORT-OPTION, the next char is the command
+        static const uint8_t comPortSb[] = { 255, 250, 44 };
+        if (tnMatch == sizeof(comPortSb)) {
+            comPortReplies.push_back(c);
+            tnMatch = 0;
+            continue;
+        }
+        tnMatch = (uint8_t)c == comPortSb[tnMatch] ? tnMatch+1 : (uint8_t)c == 255;
+        if (c == '[' || c == ']') { inStamp = c == '['; continue; } // history timestamp
+        if (inStamp) continue;
+        if (c >= '0' && c <= '9') { line += c; continue; }
+        if (c != '\n') continue; // framing
+        char *end;
+        unsigned long l = strtoul(line.c_str(), &end, 10);
+        if (line.size() == 8 && *end == 0 && l < joinLine) {
+            replayed++; // from the history, sent before the peer connected
+        } else if (line.size() == 8 && *end == 0 && l < device.lineTime.size()) {
+            latency.push_back(now - device.lineTime[l]);
+        } else {
+            badLines++;
+        }
+        line.clear();
+    }
+    unread.erase(0, n);
+    bytesRead += n;
+}
+
+// readTick runs every millisecond for peers that read slowly or stall
+void Peer::readTick() {
+    if (closed) return;
+    bool stalled = stallEvery > 0 && (now/1000) % stallEvery < stallFor;
+    if (!stalled && !unread.empty()) {
+        size_t wndBefore = bufSz - unread.size();
+        size_t n = readBps == 0 ? unread.size() : std::max(readBps/1000, 1u);
+        if (n > unread.size()) n = unread.size();
+        consume(n);
+        if (wndBefore < 2*mss) sendAck(); // window update
+    }
+    at(now + 1000, [this]() { readTick(); });
+}
+
+// uploadChar returns the char at offset off of the upload stream: lines of 25 chars identifying
+// the peer, framed like the device's lines
+char Peer::uploadChar(uint32_t off) {
+    uint32_t unit = 26 + (framing == 1 ? 1 : framing == 2 ? 2 : 0);
+    uint32_t i = off % unit;
+    if (framing == 2) {
+        if (i < 2) return i == 0 ? 0 : 26;
+        i -= 2;
+    }
+    return i < 25 ? 'a' + id%26 : i == 25 ? '\n' : (char)0xC0;
+}
+
+// pump sends as much data as the bridge's window allows
+void Peer::pump() {
+    while (txLeft > 0 && !closed) {
+        int32_t usable = (int32_t)(sndRight - sndNxt);
+        if (usable <= 0) return;
+        uint32_t len = std::min<uint64_t>(std::min<uint32_t>(usable, mss), txLeft);
+        std::string data(len, 0);
+        for (uint32_t i=0; i<len; i++) data[i] = uploadChar(txBytes+i);
+        sndNxt += len;
+        txLeft -= len;
+        txBytes += len;
+        transmit(len, [this, data]() { if (client && !closed) client->recvSeg(data); });
+    }
+}
+
+// sendRaw sends data, e.g. telnet commands, ahead of any upload, ignoring the bridge's window
+void Peer::sendRaw(const std::string &data) {
+    if (closed) return;
+    sndNxt += data.size();
+    transmit(data.size(), [this, data]() { if (client && !closed) client->recvSeg(data); });
+}
+
+void Peer::recvAck(uint32_t ackno, uint32_t right) {
+    if ((int32_t)(ackno - sndUna) > 0) sndUna = ackno;
+    if ((int32_t)(right - sndRight) > 0) sndRight = right;
+    pump();
+}
+
+void Peer::disconnect() {
+    if (closed) return;
+    closed = true;
+    if (client) client->close(true);
+}
+
+IPAddress Peer::ip() { return IPAddress(192, 168, 0, 100 + id%100); }
+uint16_t Peer::port() { return 40000 + id; }
+
+// sendDatagram sends a datagram with the next sequence number and the payload to the bridge
+void Peer::sendDatagram(uint16_t to, const std::string &payload) {
+    std::string data(2, 0);
+    data[0] = udpSeq >> 8;
+    data[1] = udpSeq & 0xff;
+    udpSeq++;
+    data += payload;
+    txBytes += payload.size();
+    if (rand() % 100 < (int)udpLoss) return;
+    transmit(data.size(), [this, data, to]() {
+        for (AsyncUDP *u : udps) {
+            if (u->_port != to || !u->_cb) continue;
+            AsyncUDPPacket pkt(data, ip(), port());
+            u->_cb(u->_cbArg, pkt);
+        }
+    });
+}
+
+// recvDatagram checks the sequence number of a datagram from the bridge and parses the lines
+void Peer::recvDatagram(const std::string &data) {
+    if (data.size() < 2) return;
+    uint16_t seq = (uint8_t)data[0] << 8 | (uint8_t)data[1];
+    udpLost += (uint16_t)(seq - udpNext);
+    udpNext = seq + 1;
+    unread += data.substr(2);
+    rcvNxt += data.size() - 2;
+    consume(unread.size());
+}
+
+Peer *subscribe(uint16_t port) {
+    Peer *p = new Peer();
+    p->id = peers.size();
+    p->udp = true;
+    p->joinLine = device.lineTime.size();
+    peers.push_back(p);
+    p->sendDatagram(port, "");
+    return p;
+}
+
+Peer *wsConnect(AsyncWebSocket *ws) {
+    Peer *p = new Peer();
+    p->id = peers.size();
+    p->ws = true;
+    p->bufSz = 4*mss;
+    p->client = new AsyncClient(p);
+    p->client->_peerWnd = p->bufSz;
+    p->sndRight = TCP_WND;
+    peers.push_back(p);
+    AsyncWebSocketClient *c = new AsyncWebSocketClient(p->client, ws);
+    ws->_handleEvent(c, WS_EVT_CONNECT, 0, 0, 0);
+    at(now + 1000, [p]() { p->readTick(); });
+    return p;
+}
+
+Peer *connect(uint16_t port) {
+    for (AsyncServer *s : servers) {
+        if (s->_port != port || !s->_cb) continue;
+        Peer *p = new Peer();
+        p->id = peers.size();
+        p->joinLine = device.lineTime.size();
+        p->bufSz = 4*mss;
+        p->client = new AsyncClient(p);
+        p->client->_peerWnd = p->bufSz;
+        p->sndRight = TCP_WND;
+        peers.push_back(p);
+        if (s->_noDelay) p->client->setNoDelay(true);
+        s->_cb(s->_cbArg, p->client);
+        at(now + 1000, [p]() { p->readTick(); });
+        return p;
+    }
+    return 0;
+}
+
+} // namespace sim
+
+using namespace sim;
+// ===== Optiboot
+
+int Optiboot::nextByte(uint64_t t) {
+    if (resp.empty() || resp.front().first > t) return -1;
+    uint8_t c = resp.front().second;
+    resp.pop_front();
+    return c;
+}
+
+void Optiboot::reply(uint64_t t, const uint8_t *data, size_t len) {
+    for (size_t i=0; i<len; i++) resp.push_back(std::make_pair(t, data[i]));
+}
+
+void Optiboot::recvByte(uint8_t c, uint64_t t) {
+    if (t < busyUntil) {
+        if (++busyChars > 2) {
+            lost++;
+            return;
+        }
+    } else {
+        busyChars = 0;
+    }
+    cmd += (char)c;
+
+    // figure out the length of the command
+    size_t len = 2;
+    switch ((uint8_t)cmd[0]) {
+    case STK_GET_PARAMETER: len = 3; break;
+    case STK_LOAD_ADDRESS: len = 4; break;
+    case STK_PROG_PAGE:
+        if (cmd.size() < 3) return;
+        len = 5 + ((uint8_t)cmd[1]<<8 | (uint8_t)cmd[2]);
+        break;
+    }
+    if (cmd.size() < len) return;
+    std::string cmdBuf = cmd;
+    cmd.clear();
+    if ((uint8_t)cmdBuf[len-1] != CRC_EOP) {
+        bad++;
+        return;
+    }
+
+    const uint8_t insync = STK_INSYNC, ok = STK_OK;
+    reply(t, &insync, 1);
+    switch ((uint8_t)cmdBuf[0]) {
+    case STK_READ_SIGN: {
+        const uint8_t sig[] = { 0x1e, 0x95, 0x0f };
+        reply(t, sig, sizeof(sig));
+        break; }
+    case STK_GET_PARAMETER: {
+        const uint8_t vers = (uint8_t)cmdBuf[1] == 0x81 ? 8 : 0; // optiboot 8.0
+        reply(t, &vers, 1);
+        break; }
+    case STK_LOAD_ADDRESS:
+        addr = ((uint8_t)cmdBuf[1] | (uint8_t)cmdBuf[2]<<8) * 2;
+        break;
+    case STK_PROG_PAGE: {
+        size_t n = len-5;
+        for (size_t i=0; i<n && addr+i < flash.size(); i++) flash[addr+i] = cmdBuf[4+i];
+        pages++;
+        busyUntil = t + pageWriteUs;
+        t = busyUntil;
+        break; }
+    case STK_LEAVE_PROGMODE:
+        left = true;
+        break;
+    }
+    reply(t, &ok, 1);
+}
+
+// ===== Arduino
+
+uint32_t millis() { return now / 1000; }
+uint32_t micros() { return (uint32_t)now; }
+void delay(uint32_t ms) { now += ms*1000; Serial.advance(now); }
+void delayMicroseconds(uint32_t us) { now += us; Serial.advance(now); }
+void yield() {}
+void pinMode(uint8_t pin, uint8_t mode) {}
+void digitalWrite(uint8_t pin, uint8_t val) { if (pin < 17) pins[pin] = val; }
+int digitalRead(uint8_t pin) {
+    if (pin == device.ctsPin) device.updateCts();
+    return pin < 17 ? pins[pin] : 0;
+}
+
+// ===== HardwareSerial
+
+HardwareSerial Serial(0);
+
+HardwareSerial::HardwareSerial(int uart_nr) : _nr(uart_nr), _baud(115200), _config(SERIAL_8N1),
+    _rxBuf(256),
+    _rxRd(0), _rxLen(0), _overrun(false), _rxNext(0), _txNext(0), _now(0) {}
+
+void HardwareSerial::begin(unsigned long baud, SerialConfig config) {
+    _baud = baud;
+    _config = config;
+    _now = now*10;
+    _rxNext = _now + byteTime();
+    _txNext = _now;
+}
+
+void HardwareSerial::updateBaudRate(unsigned long baud) { _baud = baud; }
+
+void UartClkDiv::operator=(uint32_t div) {
+    if (nr == 0 && div > 0) Serial.updateBaudRate(ESP8266_CLOCK/div);
+}
+
+size_t HardwareSerial::setRxBufferSize(size_t size) {
+    _rxBuf.assign(size, 0);
+    _rxRd = _rxLen = 0;
+    return size;
+}
+
+int HardwareSerial::available() { advance(now); return _rxLen; }
+int HardwareSerial::availableForWrite() { advance(now); return UART_TX_FIFO_SIZE - _txFifo.size(); }
+int HardwareSerial::peek() { advance(now); return _rxLen ? _rxBuf[_rxRd] : -1; }
+
+int HardwareSerial::read() {
+    advance(now);
+    if (_rxLen == 0) return -1;
+    uint8_t c = _rxBuf[_rxRd];
+    _rxRd = (_rxRd+1) % _rxBuf.size();
+    _rxLen--;
+    return c;
+}
+
+size_t HardwareSerial::read(char *buffer, size_t size) {
+    advance(now);
+    size_t n = 0;
+    while (n < size && _rxLen > 0) {
+        size_t chunk = std::min(std::min(size-n, _rxLen), _rxBuf.size()-_rxRd);
+        memcpy(buffer+n, &_rxBuf[_rxRd], chunk);
+        _rxRd = (_rxRd+chunk) % _rxBuf.size();
+        _rxLen -= chunk;
+        n += chunk;
+    }
+    return n;
+}
+
+// write blocks, i.e. advances the clock, if the tx fifo doesn't have space, just like the real
+// driver busy-waits
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size) {
+    advance(now);
+    for (size_t i=0; i<size; i++) {
+        while (_txFifo.size() >= UART_TX_FIFO_SIZE) {
+            now = (_txNext+9)/10;
+            advance(now);
+        }
+        if (_txFifo.empty() && _txNext < _now) _txNext = _now;
+        if (_txFifo.empty()) _txNext = _now + byteTime();
+        _txFifo.push_back(buffer[i]);
+    }
+    return size;
+}
+
+void HardwareSerial::flush() {
+    while (!_txFifo.empty()) {
+        now = (_txNext+9)/10;
+        advance(now);
+    }
+}
+
+bool HardwareSerial::hasOverrun() {
+    advance(now);
+    bool o = _overrun;
+    _overrun = false;
+    return o;
+}
+
+void HardwareSerial::advance(uint64_t t) {
+    uint64_t tt = t*10;
+    if (tt < _now) return;
+    _now = tt;
+    // receive from the device
+    while (_rxNext <= tt) {
+        if (device.load <= 0 || !device.clearToSend()) {
+            _rxNext = tt + byteTime();
+            break;
+        }
+        int c;
+        if (optiboot) {
+            c = optiboot->nextByte(_rxNext/10);
+            if (c < 0) {
+                _rxNext += byteTime(); // optiboot has nothing to say (yet)
+                continue;
+            }
+        } else {
+            uint64_t saved = now;
+            now = _rxNext/10;
+            c = device.nextByte();
+            now = saved;
+        }
+        if (_rxLen < _rxBuf.size()) {
+            _rxBuf[(_rxRd+_rxLen) % _rxBuf.size()] = c;
+            _rxLen++;
+            device.losing = false;
+        } else {
+            _overrun = true;
+            device.lostBytes++;
+            if (!device.losing) device.overruns++;
+            device.losing = true;
+        }
+        _rxNext += (uint64_t)(byteTime() / device.load);
+    }
+    // transmit to the device
+    while (!_txFifo.empty() && _txNext <= tt) {
+        if (optiboot) optiboot->recvByte(_txFifo.front(), _txNext/10);
+        else device.recvByte(_txFifo.front());
+        _txFifo.pop_front();
+        _txNext += byteTime();
+    }
+}
+
+// ===== AsyncServer
+
+void AsyncServer::begin() { servers.push_back(this); }
+
+// ===== AsyncWebSocketClient
+
+AsyncWebSocketClient::AsyncWebSocketClient(AsyncClient *client, AsyncWebSocket *server) :
+        _tempObject(0), _client(client), _server(server) {
+    client->onAck([](void *r, AsyncClient *c, size_t len, uint32_t time) {
+        ((AsyncWebSocketClient*)r)->_onAck(len); }, this);
+    client->onData([](void *r, AsyncClient *c, void *data, size_t len) {
+        ((AsyncWebSocketClient*)r)->_onData(data, len); }, this);
+    client->onDisconnect([](void *r, AsyncClient *c) {
+        ((AsyncWebSocketClient*)r)->_onDisconnect(); delete c; }, this);
+}
+
+AsyncWebSocketClient::~AsyncWebSocketClient() {}
+
+void AsyncWebSocketClient::binary(const uint8_t *message, size_t len) {
+    if (queueIsFull()) return; // the real thing drops it too
+    Msg m;
+    m.data += (char)0x82;
+    if (len < 126) {
+        m.data += (char)len;
+    } else {
+        m.data += (char)126;
+        m.data += (char)(len >> 8);
+        m.data += (char)(len & 0xff);
+    }
+    m.data.append((const char*)message, len);
+    m.sent = m.acked = 0;
+    _queue.push_back(m);
+    _runQueue();
+}
+
+void AsyncWebSocketClient::close(uint16_t code, const char *message) {
+    if (_client) _client->close(true);
+}
+
+void AsyncWebSocketClient::_runQueue() {
+    bool added = false;
+    for (Msg &m : _queue) {
+        if (!_client || m.sent == m.data.size()) continue;
+        size_t n = _client->add(&m.data[m.sent], m.data.size() - m.sent, ASYNC_WRITE_FLAG_COPY);
+        m.sent += n;
+        added |= n > 0;
+        if (m.sent < m.data.size()) break;
+    }
+    if (added) _client->send();
+}
+
+void AsyncWebSocketClient::_onAck(size_t len) {
+    while (len > 0 && !_queue.empty()) {
+        Msg &m = _queue.front();
+        size_t n = std::min(len, m.sent - m.acked);
+        m.acked += n;
+        len -= n;
+        if (m.acked < m.data.size()) break;
+        _queue.pop_front();
+    }
+    _runQueue();
+}
+
+void AsyncWebSocketClient::_onData(void *data, size_t len) {
+    AwsFrameInfo info = AwsFrameInfo();
+    info.message_opcode = info.opcode = WS_BINARY;
+    info.final = 1;
+    info.len = len;
+    _server->_handleEvent(this, WS_EVT_DATA, &info, (uint8_t*)data, len);
+}
+
+void AsyncWebSocketClient::_onDisconnect() {
+    _server->_handleEvent(this, WS_EVT_DISCONNECT, 0, 0, 0);
+    _client = 0;
+    delete this;
+}
+
+// ===== AsyncUDP
+
+bool AsyncUDP::listen(uint16_t port) {
+    _port = port;
+    udps.push_back(this);
+    return true;
+}
+
+void AsyncUDP::close() {
+    udps.erase(std::remove(udps.begin(), udps.end(), this), udps.end());
+}
+
+size_t AsyncUDP::writeTo(const uint8_t *data, size_t len, const IPAddress addr, uint16_t port) {
+    for (Peer *p : peers) {
+        if (!p->udp || p->ip() != addr || p->port() != port) continue;
+        if (rand() % 100 < (int)udpLoss) return len;
+        std::string d((const char*)data, len);
+        transmit(len, [p, d]() { p->recvDatagram(d); });
+    }
+    return len;
+}
+void AsyncServer::end() {
+    servers.erase(std::remove(servers.begin(), servers.end(), this), servers.end());
+}
+
+// ===== AsyncClient
+
+AsyncClient::AsyncClient(Peer *peer) : _peer(peer), _connected(true), _noDelay(false),
+    _ackLater(false), _rxTimeout(0), _ackTimeout(0), _lastRx(millis()), _lastAck(millis()),
+    _unsentLen(0), _unackedLen(0), _txIdx(0), _txOff(0), _ackOff(0), _sndNxt(0), _sndUna(0),
+    _peerWnd(0), _peerAck(0),
+    _rcvNxt(0), _rcvRecved(0), _rcvAdvertised(TCP_WND), _unackedSegs(0),
+    _dataArg(0), _ackArg(0), _errorArg(0), _discArg(0), _timeoutArg(0), _pollArg(0) {
+    liveClients++;
+}
+
+AsyncClient::~AsyncClient() {
+    liveClients--;
+    if (_peer) _peer->client = 0;
+}
+
+IPAddress AsyncClient::remoteIP() { return IPAddress(192, 168, 0, 100); }
+uint16_t AsyncClient::remotePort() { return 40000; }
+
+void AsyncClient::close(bool now) {
+    if (!_connected) return;
+    _connected = false;
+    if (_peer) _peer->closed = true;
+    if (_discCb) _discCb(_discArg, this);
+}
+
+size_t AsyncClient::space() {
+    if (!_connected) return 0;
+    return TCP_SND_BUF - _unsentLen - _unackedLen;
+}
+
+size_t AsyncClient::add(const char *data, size_t size, uint8_t apiflags) {
+    if (!_connected || size == 0 || data == 0) return 0;
+    size_t n = std::min(size, space());
+    if (n == 0) return 0;
+    Seg s;
+    s.ref = (apiflags & ASYNC_WRITE_FLAG_COPY) ? 0 : data;
+    s.data.assign(data, n);
+    _segs.push_back(s);
+    _unsentLen += n;
+    return n;
+}
+
+bool AsyncClient::send() {
+    if (!_connected) return false;
+    output();
+    return true;
+}
+
+// output transmits segments as allowed by the peer's window and Nagle's algorithm
+void AsyncClient::output() {
+    while (_unsentLen > 0 && _connected) {
+        int32_t usable = (int32_t)(_peerAck + _peerWnd - _sndNxt);
+        if (usable <= 0) return;
+        size_t len = std::min<size_t>(std::min<size_t>(_unsentLen, mss), usable);
+        if (!_noDelay && _unackedLen > 0 && len < mss) return; // Nagle
+        std::string data;
+        while (data.size() < len) {
+            Seg &s = _segs[_txIdx];
+            size_t n = std::min(len - data.size(), s.data.size() - _txOff);
+            if (s.ref && memcmp(s.ref+_txOff, s.data.data()+_txOff, n) != 0) zeroCopyViolations++;
+            data.append(s.data, _txOff, n);
+            _txOff += n;
+            if (_txOff == s.data.size()) { _txIdx++; _txOff = 0; }
+        }
+        _unsentLen -= len;
+        _unackedLen += len;
+        _sndNxt += len;
+        Peer *p = _peer;
+        transmit(len, [p, data]() { p->recvSeg(data); });
+    }
+}
+
+void AsyncClient::recvAck(uint32_t ackno, uint32_t right) {
+    uint32_t acked = ackno - _sndUna;
+    if ((int32_t)acked < 0 || acked > _unackedLen) return;
+    _peerAck = ackno;
+    _peerWnd = right - ackno;
+    if (acked > 0) {
+        _sndUna = ackno;
+        _unackedLen -= acked;
+        _lastAck = millis();
+        // release segments that are fully acked, checking zero-copy data was left intact
+        size_t n = acked;
+        while (n > 0) {
+            Seg &s = _segs.front();
+            size_t len = std::min(n, s.data.size() - _ackOff);
+            if (s.ref && memcmp(s.ref+_ackOff, s.data.data()+_ackOff, len) != 0) {
+                zeroCopyViolations++;
+            }
+            _ackOff += len;
+            n -= len;
+            if (_ackOff < s.data.size()) break;
+            _segs.pop_front();
+            _txIdx--;
+            _ackOff = 0;
+        }
+        if (_ackCb) _ackCb(_ackArg, this, acked, 0);
+    }
+    output();
+}
+
+void AsyncClient::recvSeg(const std::string &data) {
+    if (!_connected) return;
+    _rcvNxt += data.size();
+    _lastRx = millis();
+    _unackedSegs++;
+    _ackLater = false;
+    if (_dataCb) _dataCb(_dataArg, this, (void*)data.data(), data.size());
+    if (!_connected) return;
+    if (!_ackLater) ack(data.size());
+    if (_unackedSegs >= 2) sendAck();
+}
+
+// ack is the application acking received data, this opens up the receive window
+size_t AsyncClient::ack(size_t len) {
+    if (!_connected) return 0;
+    _rcvRecved += len;
+    uint32_t right = _rcvRecved + TCP_WND;
+    uint32_t minUpdate = std::min<uint32_t>(TCP_WND/2, TCP_MSS);
+    if (right - _rcvAdvertised >= minUpdate) {
+        uint32_t inflation = right - _rcvAdvertised;
+        if (inflation >= TCP_WND_UPDATE_THRESHOLD) {
+            _rcvAdvertised = right;
+            sendAck();
+        }
+    }
+    return len;
+}
+
+void AsyncClient::sendAck() {
+    uint32_t right = _rcvRecved + TCP_WND;
+    if (right - _rcvAdvertised >= std::min<uint32_t>(TCP_WND/2, TCP_MSS)) _rcvAdvertised = right;
+    _unackedSegs = 0;
+    uint32_t ackno = _rcvNxt, adv = _rcvAdvertised;
+    Peer *p = _peer;
+    transmit(0, [p, ackno, adv]() { if (!p->closed) p->recvAck(ackno, adv); });
+}
+
+void AsyncClient::fastTimer() {
+    if (_unackedSegs > 0) sendAck();
+    output();
+}
+
+void AsyncClient::slowTimer() {
+    if (_pollCb) _pollCb(_pollArg, this);
+    if (!_connected) return;
+    uint32_t ms = millis();
+    if (_unackedLen > 0 && _ackTimeout && ms - _lastAck >= _ackTimeout) {
+        if (_timeoutCb) _timeoutCb(_timeoutArg, this, ms - _lastAck);
+    } else if (_rxTimeout && ms - _lastRx >= _rxTimeout*1000) {
+        if (_timeoutCb) _timeoutCb(_timeoutArg, this, ms - _lastRx);
+    }
+}
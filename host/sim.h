@@ -0,0 +1,167 @@
+// Esp-link-v4 host build
+// Copyright (C) 2018 by Throsten von Eicken
+
+// The simulator provides the environment for the host build: a simulated clock, an event queue,
+// the device at the other end of the uart, and the TCP peers at the other end of AsyncClient
+// connections. Time only advances when the driver calls sim::run() or when code under test blocks,
+// e.g. in a uart write that has to wait for space in the tx fifo.
+
+#ifndef sim_h
+#define sim_h
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <functional>
+#include "Arduino.h"
+#include "ESPAsyncTCP.h"
+#include "ESPAsyncWebServer.h"
+
+namespace sim {
+
+extern uint64_t now;            // current time in microseconds
+extern uint32_t mss;            // TCP maximum segment size, TCP_WND etc. derive from it
+extern uint32_t latency;        // one-way network latency in microseconds
+extern uint32_t linkBps;        // network link rate in bits per second
+extern uint32_t udpLoss;        // percentage of datagrams lost
+extern int framing;             // frames sent by device and peers: 0=none, 1=SLIP, 2=length prefix
+
+// at schedules fn to be called at time t
+void at(uint64_t t, std::function<void()> fn);
+// run processes all events up to time t and leaves the clock at t
+void run(uint64_t t);
+// reset clears all state so a new simulation can be started
+void reset();
+
+// Device models what is connected to the uart. It transmits numbered text lines so that the
+// latency from the uart to each TCP peer can be measured.
+struct Device {
+    double load;                 // fraction of the line rate the device transmits at
+    int rtsPin;                  // esp gpio used as RTS, the device pauses when it is high
+    int ctsPin;                  // esp gpio used as CTS, driven by the device
+    uint32_t sinkBuf;            // device rx buffer size, 0 for an infinitely fast device
+    uint32_t sinkBps;            // rate at which the device processes received bytes
+    // state and stats
+    uint32_t line;               // number of the line being transmitted
+    std::string lineBuf;         // remainder of the line being transmitted
+    std::vector<uint64_t> lineTime; // time at which each line was received by the esp
+    uint64_t txBytes;            // bytes transmitted to the esp
+    uint64_t lostBytes;          // bytes lost due to uart rx buffer overflow
+    uint32_t overruns;           // number of overrun events, i.e., runs of lost bytes
+    bool losing;                 // last byte was lost
+    uint64_t rxBytes;            // bytes received from the esp
+    uint32_t rxLines;            // lines received from the esp
+    uint32_t rxMixed;            // lines received that mix the data of different peers
+    std::string rxLine;          // partial line received from the esp
+    uint64_t rxLost;             // bytes lost because sinkBuf overflowed
+    uint64_t sinkLevel;          // bytes in sinkBuf
+    uint64_t sinkAt;             // time sinkLevel was last updated
+
+    int nextByte();              // next byte for the uart to receive
+    void recvByte(uint8_t c);    // byte transmitted by the uart
+    bool clearToSend();          // esp is ready to receive (RTS)
+    void updateCts();
+};
+extern Device device;
+
+// Optiboot models the optiboot bootloader of an ATmega328P at the other end of the uart, it takes
+// the place of the device while it's set. It answers the STK500 commands AVRFlash sends and writes
+// the pages into its flash. Like the real thing it doesn't read its uart while it writes a page,
+// which takes pageWriteUs, so beyond the 2 chars the AVR's uart buffers what arrives is lost.
+struct Optiboot {
+    uint32_t pageWriteUs = 4500;
+    std::vector<uint8_t> flash = std::vector<uint8_t>(32*1024, 0xff);
+    // state
+    std::string cmd;             // command being received
+    std::deque<std::pair<uint64_t, uint8_t>> resp; // chars to transmit and when they're ready
+    uint64_t busyUntil = 0;      // writing a page until then
+    uint32_t busyChars = 0;      // chars received while writing the page
+    uint32_t addr = 0;           // byte address set by STK_LOAD_ADDRESS
+    // stats
+    uint32_t pages = 0;          // pages written
+    uint32_t lost = 0;           // chars lost while writing a page
+    uint32_t bad = 0;            // malformed commands, the real thing would reset
+    bool left = false;           // got STK_LEAVE_PROGMODE
+
+    int nextByte(uint64_t t);    // next char for the uart to receive at time t, -1 if none
+    void recvByte(uint8_t c, uint64_t t); // char transmitted by the uart at time t
+    void reply(uint64_t t, const uint8_t *data, size_t len);
+};
+extern Optiboot *optiboot;
+
+// Peer is the remote end of a TCP connection.
+struct Peer {
+    AsyncClient *client;         // bridge-side handle, null once deleted
+    bool closed;
+    bool dead;                   // peer vanished without closing, e.g. its wifi dropped
+    // receive direction (bridge to peer)
+    uint32_t rcvNxt;             // bytes received
+    uint32_t bufSz;              // receive buffer size, i.e., max window
+    std::string unread;          // bytes received but not read by the application
+    uint32_t readBps;            // rate at which the application reads, 0 for immediately
+    uint32_t stallEvery, stallFor; // application stops reading for stallFor ms every stallEvery ms
+    std::string line;            // partial text line
+    std::vector<uint32_t> latency; // latency of each complete line in microseconds
+    uint64_t bytesRead;
+    uint32_t badLines;           // lines that didn't parse, e.g. due to dropped data
+    uint32_t splitFrames;        // frames received split across segments
+    uint32_t frameOff;           // offset in the length-prefixed frame being received
+    bool inStamp;                // receiving a history timestamp
+    uint32_t joinLine;           // first line the device transmitted after the peer connected
+    uint32_t replayed;           // lines received from before the peer connected
+    std::vector<uint8_t> comPortReplies; // RFC 2217 responses received, i.e. the command + 100
+    uint8_t tnMatch;             // chars of IAC SB COM-PORT-OPTION matched so far
+    // send direction (peer to bridge)
+    uint64_t txLeft;             // bytes still to be sent, lines of 25 chars identifying the peer
+    uint32_t sndNxt, sndUna;     // sequence numbers
+    uint32_t sndRight;           // right edge of the window advertised by the bridge
+    uint64_t txBytes;
+
+    int id;
+    // UDP peers only: they subscribe by sending datagrams and receive datagrams
+    bool udp;
+    uint16_t udpSeq;             // sequence number of the next datagram to send
+    uint16_t udpNext;            // sequence number of the next datagram expected
+    uint32_t udpLost;            // datagrams missing from the sequence
+    // WebSocket peers only: the frame headers are stripped from the data received
+    bool ws;
+    std::string wsHdr;           // frame header being received
+    uint32_t wsLeft;             // payload left in the current frame
+
+    Peer();
+    void recvSeg(const std::string &data);
+    void recvAck(uint32_t ackno, uint32_t right);
+    void readTick();
+    void consume(size_t n);
+    void pump();
+    void sendRaw(const std::string &data);
+    char uploadChar(uint32_t off);
+    void disconnect();
+    void sendAck();
+    IPAddress ip();
+    uint16_t port();
+    void sendDatagram(uint16_t to, const std::string &payload);
+    void recvDatagram(const std::string &data);
+};
+
+// connect opens a new connection to the AsyncServer listening on port
+Peer *connect(uint16_t port);
+// wsConnect opens a new connection to a WebSocket endpoint
+Peer *wsConnect(AsyncWebSocket *ws);
+// subscribe creates a UDP peer that sends an empty datagram to port
+Peer *subscribe(uint16_t port);
+// peers holds all peers ever connected
+extern std::vector<Peer*> peers;
+// transmit schedules fn to be called when a packet of len bytes arrives at the other end
+void transmit(size_t len, std::function<void()> fn);
+
+extern uint32_t zeroCopyViolations; // referenced data changed before it was acked
+extern uint32_t liveClients;        // AsyncClients that have not been deleted
+
+// gpio state
+extern uint8_t pins[17];
+
+} // namespace sim
+
+#endif // sim_h
@@ -0,0 +1,101 @@
+// Esp-link-v4 host build
+// Copyright (C) 2018 by Throsten von Eicken
+
+// tracedump decodes a dump of the trace ring, see TraceRing.h, into a timeline with one event per
+// line: the time since the first event in seconds, the time since the previous event in
+// microseconds, and the event formatted as listed in TraceEvents.h. The dump can be captured from
+// the serial port or with e.g. `nc esp-link 2324 > trace.bin`.
+//
+// Usage: tracedump [-g gap_us] [-s] [file]
+//   -g marks the gaps between events of gap_us or more, e.g. the stalls of a stop&go flow
+//   -s prints the number of events of each kind and the longest gaps instead of the timeline
+//
+// The dump is read from stdin if no file is given.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+#include "TraceRing.h"
+
+#define TRACE_NAME(id, fmt) #id,
+static const char *names[] = { TRACE_EVENTS(TRACE_NAME) };
+#undef TRACE_NAME
+#define TRACE_FMT(id, fmt) fmt,
+static const char *formats[] = { TRACE_EVENTS(TRACE_FMT) };
+#undef TRACE_FMT
+
+struct Gap {
+    uint64_t at, len;
+};
+
+int main(int argc, char **argv) {
+    uint32_t gapUs = 0;
+    bool summary = false;
+    int c;
+    while ((c = getopt(argc, argv, "g:s")) != -1) {
+        switch (c) {
+        case 'g': gapUs = atoi(optarg); break;
+        case 's': summary = true; break;
+        default:
+            fprintf(stderr, "usage: tracedump [-g gap_us] [-s] [file]\n");
+            return 1;
+        }
+    }
+    FILE *f = stdin;
+    if (optind < argc && (f = fopen(argv[optind], "rb")) == 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    TraceHdr hdr;
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != TRACE_MAGIC) {
+        fprintf(stderr, "not a trace dump\n");
+        return 1;
+    }
+    if (hdr.recSize != sizeof(TraceRec)) {
+        fprintf(stderr, "records of %d bytes, expected %d\n", hdr.recSize, (int)sizeof(TraceRec));
+        return 1;
+    }
+    if (hdr.events != trNumEvents) {
+        fprintf(stderr, "warning: the device knows %d events, this decoder %d\n", hdr.events,
+                trNumEvents);
+    }
+    printf("# %u events, %u lost before the dump\n", hdr.count, hdr.lost);
+
+    // the timestamps are micros() and wrap around every 71 minutes, so the time is accumulated
+    // from the differences
+    std::vector<uint32_t> counts(trNumEvents+1);
+    std::vector<Gap> gaps;
+    TraceRec r;
+    uint32_t n = 0, last = 0;
+    uint64_t t = 0;
+    while (n < hdr.count && fread(&r, sizeof(r), 1, f) == 1) {
+        uint32_t dt = n == 0 ? 0 : r.us - last;
+        t += dt;
+        last = r.us;
+        n++;
+        counts[r.ev < trNumEvents ? r.ev : trNumEvents]++;
+        if (gapUs > 0 && dt >= gapUs) gaps.push_back(Gap{t-dt, dt});
+        if (summary) continue;
+        if (gapUs > 0 && dt >= gapUs) printf("# ----- %u us gap -----\n", dt);
+        printf("%11.6f +%-8u ", t/1e6, dt);
+        if (r.ev < trNumEvents) printf(formats[r.ev], r.a, r.b);
+        else printf("event %u %u %u", r.ev, r.a, r.b);
+        printf("\n");
+    }
+    if (n < hdr.count) fprintf(stderr, "dump truncated after %u events\n", n);
+    if (!summary) return 0;
+
+    printf("# %.6f s\n", t/1e6);
+    for (int i=0; i<=trNumEvents; i++) {
+        if (counts[i]) printf("%-20s %8u\n", i < trNumEvents ? names[i] : "unknown", counts[i]);
+    }
+    std::sort(gaps.begin(), gaps.end(), [](const Gap &a, const Gap &b) { return a.len > b.len; });
+    for (size_t i=0; i<gaps.size() && i<10; i++) {
+        printf("gap of %llu us at %.6f s\n", (unsigned long long)gaps[i].len, gaps[i].at/1e6);
+    }
+    return 0;
+}